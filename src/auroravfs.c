@@ -29,10 +29,256 @@
 **    freeonclose=  If true, then sqlite3_free() is called on the ptr=
 **                  value when the connection closes.
 **
+**    backend=      How the region is persisted:
+**
+**                      sls           snapshots of the region by the SLS,
+**                                    on the SAS fd given by fd= (the
+**                                    default, if built with the SLS)
+**                      file          the dirty ranges are written to a
+**                                    local file and fdatasync()ed (the
+**                                    default otherwise)
+**                      uring         like file, but the ranges are
+**                                    copied to registered buffers and
+**                                    written with io_uring and O_DIRECT,
+**                                    followed by a drained fsync. Only
+**                                    available on Linux when built with
+**                                    -DAURORA_HAVE_URING
+**                      pmem          the region is a file mapped shared,
+**                                    and checkpoints msync() the dirty
+**                                    ranges. With pmemDax= they flush
+**                                    the cache lines of the ranges and
+**                                    fence instead, which with
+**                                    dirtyPgsz=64 is exactly the lines
+**                                    written
+**                      fork          like file, but each checkpoint
+**                                    forks, and the child writes the
+**                                    dirty ranges out of its copy of the
+**                                    region while we go on. ptr= must
+**                                    be private memory for the copy to
+**                                    be point in time. Needs
+**                                    ckptMode=async
+**                      log           the dirty pages are appended to
+**                                    a redo log as page records, see
+**                                    delta= and compress=, and the log
+**                                    is rewritten as a snapshot of the
+**                                    whole region once it grows past
+**                                    logMax=. Opening with sz=0 replays
+**                                    an existing log into the region
+**                      none          nothing is persisted, for
+**                                    measuring the cost of the rest
+**
+**                  The file backends copy the whole region to the file
+**                  when opening. A crash in the middle of a checkpoint
+**                  may leave the file torn, so it is meant for
+**                  development and comparisons rather than production.
+**
+**    fd=           The SAS fd of the region, for backend=sls.
+**
+**    backendPath=  The file written by backend=file, uring, fork or log.
+**                  Defaults to the
+**                  database name with "-img" appended.
+**
+**    restore=      For backend=file and backend=uring, start from the
+**                  image in backendPath=, if there is one, rather than
+**                  overwriting it with the region. sz= is then the size
+**                  of the image, and the region, which must be fresh
+**                  anonymous memory aligned to pages, is filled:
+**
+**                      eager         before the open returns
+**                      lazy          on Linux, by a background thread
+**                                    that copies the image in order
+**                                    while serving page faults on the
+**                                    region from userfaultfd first, so
+**                                    that the open returns right away.
+**                                    Falls back to eager where
+**                                    userfaultfd is not available
+**
+**    prefault=     Number of threads that populate the region up to sz=
+**                  when opening, so that queries do not stall on page
+**                  faults later, with MADV_POPULATE_WRITE where the
+**                  system has it. How long it took is reported by
+**                  AURORA_FCNTL_PREFAULT. 0 (the default) disables it.
+**                  With restore=lazy the pages are restored as they are
+**                  populated, so the open takes as long as restore=eager.
+**
+**    mlock=        If true, prefault= also locks the populated region
+**                  in memory, where RLIMIT_MEMLOCK allows. It stays
+**                  locked after the file is closed.
+**
+**    hotset=       A file to warm the region from. Reads of the region
+**                  are sampled, and the 64 KiB chunks they hit are
+**                  written to it in the order first seen when the file
+**                  is closed. The next open prefetches those chunks, in
+**                  that order, from background threads while queries
+**                  run. With restore=lazy this restores the hot chunks
+**                  first. Off by default.
+**
+**    hotsetSample= Record one read of the region in this many. The
+**                  default is 8.
+**
+**    hotsetThreads= Threads that prefetch the hot set, 2 by default.
+**
+**    forkMax=      For backend=fork, the largest database in bytes that
+**                  is checkpointed by forking. Larger ones, whose page
+**                  tables take long to copy and which risk duplicating
+**                  much of the region while the child runs, are written
+**                  out by the checkpointing thread itself, as they are
+**                  when fork() fails. 0 (the default) means no limit.
+**
+**    pmemDax=      For backend=pmem, if true, the region is persistent
+**                  memory mapped with MAP_SYNC, e.g. from a DAX file
+**                  system, where flushing the CPU caches makes it
+**                  durable. Elsewhere the dirty pages sit in the page
+**                  cache, so this is false by default.
+**
+**    logMax=       For backend=log, the size in bytes past which the log
+**                  is compacted into a snapshot. Defaults to twice the
+**                  size of the database.
+**
+**    ckptMode=     Either "sync" (the default), where checkpoints run
+**                  inline in xWrite()/xSync(), or "async", where they
+**                  are handed off to a per-file checkpointer thread. It
+**                  takes its snapshot between transactions, holding new
+**                  ones back only until it has frozen the dirty pages,
+**                  so async mode needs cow= with backend=file, uring or
+**                  log, or else backend=fork or none. backend=sls and
+**                  pmem read the live region until the snapshot is
+**                  durable, and are sync only.
+**
+**    maxLag=       In async mode, the number of checkpoint epochs writers
+**                  may get ahead of the last completed checkpoint before
+**                  they block. Defaults to 2.
+**
+**    groupCommitUs= Window in microseconds during which checkpoint
+**                  requests from all connections sharing the same fd=
+**                  are coalesced into a single snapshot. 0 (the default)
+**                  disables group commit.
+**
+**    dirtyPgsz=    Granularity in bytes (a power of two) at which writes
+**                  are tracked between checkpoints. Defaults to 4096; 0
+**                  turns dirty tracking off.
+**
+**    cow=          If true, pages frozen for an async checkpoint are
+**                  copied on their first write until the checkpoint has
+**                  persisted them, so writers never wait for it and it
+**                  always sees the image as of its start. Requires
+**                  ckptMode=async and dirty tracking, and backend=file,
+**                  uring or log. Defaults to true where it can be used.
+**
+**    skipSame=     If true (the default), writes are compared with the
+**                  current contents first, and pages they leave as they
+**                  are neither count as written nor become dirty.
+**
+**    pageHash=     If true, keep a 64-bit hash of every page as last
+**                  checkpointed, and drop dirty pages whose contents
+**                  hash the same from the next checkpoint. Requires
+**                  dirty tracking.
+**
+**    delta=        For persistence backends that log page records, if
+**                  true, encode each dirty page as a run-length encoded
+**                  XOR against its previously persisted image. Keeps a
+**                  copy of every persisted page in memory.
+**
+**    compress=     For backends that log page records, if true, further
+**                  compress the records with zstd. Only available when
+**                  built with -DAURORA_HAVE_ZSTD.
+**
+**    policy=       When to checkpoint, as an expression over the policies
+**                  below. Arguments are plain integers.
+**
+**                      sync          on xSync(), if anything was written
+**                      bytes:N       once more than N bytes were written
+**                      commits:N     once N transactions committed
+**                      time:MS       once MS milliseconds passed since
+**                                    the last checkpoint
+**                      idle:MS       once no write happened for MS
+**                                    milliseconds (async mode only)
+**                      and(P,...)    once all of the policies agree
+**                      or(P,...)     once any of the policies agrees
+**                      adaptive      once more than the adaptive
+**                                    threshold was written, see below
+**
+**                  Checkpoints other than "sync" ones are taken at the
+**                  end of a transaction. In async mode, time and idle
+**                  policies are also polled by the checkpointer between
+**                  transactions. If policy= is omitted, the legacy
+**                  threshold=N and ckptOnSync=B parameters (defaulting
+**                  to 0 and 1) select or(bytes:N,sync).
+**
+**                  In WAL mode the database only changes when SQLite
+**                  copies the WAL back into it. Policies are held while
+**                  it does so, and every such WAL checkpoint is followed
+**                  by exactly one checkpoint of ours.
+**
+**    flushThreads= For persistence backends that write out the dirty
+**                  ranges of the region, the number of threads that
+**                  flush a checkpoint in parallel. Defaults to 1, i.e.
+**                  the checkpointing thread does all the work.
+**
+**    ckptBandwidth= Upper bound in bytes per second on the I/O of
+**                  checkpoints, so that they do not starve foreground
+**                  work. Bursts of up to one second worth of bandwidth
+**                  are allowed. 0 (the default) means no limit.
+**
+**    highWater=    Once more than this many bytes were written but are
+**                  not durable yet, writers are slowed down in xWrite(),
+**                  increasingly so the further they are past the mark,
+**                  giving the checkpointer time to catch up. 0 (the
+**                  default) disables throttling.
+**
+**    ckptSlots=    Process-wide cap on the number of checkpoints running
+**                  at the same time, across all aurora-files. Queued
+**                  checkpoints are run in turn, sharing fairly between
+**                  tenants and then preferring the most important, the
+**                  largest and the longest waiting. The cap is set for
+**                  the process by the first file that gives one, and
+**                  only lowered by later ones, so the smallest applies.
+**                  0 (the default) leaves it as it is, unlimited unless
+**                  another file capped it.
+**
+**    tenant=       Name of the tenant the file belongs to for the
+**                  purposes of ckptSlots=. Files without it share the
+**                  unnamed tenant.
+**
+**    ckptPriority= Weight of the file's checkpoints for the purposes of
+**                  ckptSlots=, a positive integer. Defaults to 1.
+**
+**    group=        Name of a checkpoint group. The files of a group, e.g.
+**                  databases ATTACHed to the same connection, are
+**                  checkpointed together as one atomic epoch with a
+**                  single commit, once none of them is in a write
+**                  transaction anymore. All files of a group must use
+**                  ckptMode=sync, backend=sls and the same fd=.
+**
+**    targetCkptUs= Enable the adaptive threshold controller, which tunes
+**                  the byte threshold of the adaptive policy so that the
+**                  p99 snapshot duration stays at about this many
+**                  microseconds. If policy= is omitted, threshold= is
+**                  replaced by the adaptive policy and gives its initial
+**                  value.
+**
+**    targetRpo=    Upper bound in bytes for the adaptive threshold, i.e.
+**                  how much unpersisted data we are willing to lose. Can
+**                  be used with or without targetCkptUs=.
+**
+** SQL FUNCTIONS:
+**
+**    aurora_freeze(MS [, SCHEMA])
+**                  Freeze the region of a database for at most MS
+**                  milliseconds, see AURORA_FCNTL_FREEZE, and return the
+**                  image as "ptr=P&sz=N&epoch=E".
+**
+**    aurora_thaw([SCHEMA])
+**                  Thaw it again. Returns 1, or 0 if the freeze had
+**                  expired and the image may have changed meanwhile.
+**
 ** The ptr= and sz= query parameters are required.  If maxsz= is omitted,
 ** then it defaults to the sz= value.  Parameter values can be in either
 ** decimal or hexadecimal.  The filename in the URI is ignored.
 */
+#ifdef __linux__
+#define _GNU_SOURCE                 /* O_DIRECT */
+#endif
 #include "sqlite3ext.h"
 SQLITE_EXTENSION_INIT1
 #include <string.h>
@@ -40,13 +286,70 @@ SQLITE_EXTENSION_INIT1
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#ifdef AURORA_HAVE_SLS
 #include <sls_wal.h>
+#endif
+#ifdef AURORA_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef AURORA_HAVE_URING
+#include <sys/uio.h>
+#include <liburing.h>
+#endif
+#ifdef __linux__
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+#if defined(SYS_userfaultfd) && defined(UFFDIO_COPY)
+#define AURORA_HAVE_UFFD
+#endif
+#endif
+
+#include "auroravfs.h"
 
 /*
 ** Forward declaration of objects used by this utility
 */
 typedef struct sqlite3_vfs AuroraVfs;
 typedef struct AuroraFile AuroraFile;
+typedef struct AuroraGroupCommit AuroraGroupCommit;
+typedef struct AuroraDirtyMap AuroraDirtyMap;
+typedef struct AuroraShadow AuroraShadow;
+typedef struct AuroraDurableWaiter AuroraDurableWaiter;
+typedef struct AuroraPolicy AuroraPolicy;
+typedef struct AuroraAdaptive AuroraAdaptive;
+typedef struct AuroraBackend AuroraBackend;
+typedef struct AuroraFlushPool AuroraFlushPool;
+typedef struct AuroraFlushJob AuroraFlushJob;
+typedef struct AuroraFlushBarrier AuroraFlushBarrier;
+typedef struct AuroraBucket AuroraBucket;
+typedef struct AuroraPageRec AuroraPageRec;
+typedef struct AuroraTenant AuroraTenant;
+typedef struct AuroraSchedWaiter AuroraSchedWaiter;
+typedef struct AuroraSched AuroraSched;
+typedef struct AuroraCkptGroup AuroraCkptGroup;
+typedef struct AuroraRegion AuroraRegion;
+typedef struct AuroraUring AuroraUring;
+typedef struct AuroraLog AuroraLog;
+typedef struct AuroraLogRec AuroraLogRec;
+typedef struct AuroraRestore AuroraRestore;
+typedef struct AuroraPrefaultJob AuroraPrefaultJob;
+typedef struct AuroraHot AuroraHot;
 
 /* Access to a lower-level VFS that (might) implement dynamic loading,
 ** access to randomness, etc.
@@ -56,6 +359,354 @@ typedef struct AuroraFile AuroraFile;
 
 static char *mainDbName = NULL;
 
+/* Checkpointing modes, selected with the ckptMode= URI parameter. */
+#define AURORA_CKPT_SYNC    0       /* Checkpoint inline in xWrite()/xSync() */
+#define AURORA_CKPT_ASYNC   1       /* Hand checkpoints to a background thread */
+
+/* Events checkpoint policies are evaluated on. */
+#define AURORA_EV_WRITE     0       /* xWrite() */
+#define AURORA_EV_SYNC      1       /* xSync() */
+#define AURORA_EV_COMMIT    2       /* End of a transaction */
+#define AURORA_EV_TICK      3       /* Periodic poll of the checkpointer */
+
+#define AURORA_DEFAULT_MAXLAG 2
+#define AURORA_ADAPTIVE_MIN (64 * 1024)
+#define AURORA_ADAPTIVE_INIT (1024 * 1024)
+#define AURORA_ADAPTIVE_NSAMPLE 64
+#define AURORA_DEFAULT_DIRTY_PGSZ 4096
+#define AURORA_ZSTD_LEVEL 1
+#define AURORA_THROTTLE_MAX_US 10000
+#define AURORA_THROTTLE_MIN_US 50
+
+/*
+** Set of pages of an aurora-file written since some checkpoint, one bit
+** per page. The [iLo, iHi) word range bounds the set bits so that sparse
+** maps can be scanned and cleared without touching the whole bitmap.
+*/
+struct AuroraDirtyMap {
+    sqlite3_uint64 *aBit;           /* One bit per tracked page */
+    sqlite3_int64 iLo;              /* First word that may have bits set */
+    sqlite3_int64 iHi;              /* One past the last such word */
+    sqlite3_int64 nPage;            /* Number of bits set */
+};
+
+/*
+** Copy of a frozen page taken by a writer while a checkpoint was still
+** persisting it. Lives in an open addressing hash table keyed by iPg.
+*/
+struct AuroraShadow {
+    sqlite3_int64 iPg;              /* Page number, -1 for an empty slot */
+    unsigned char *aPage;           /* Checkpoint-time page contents */
+};
+
+/*
+** Group commit state, shared by all connections that checkpoint the same
+** SAS fd. Connections that ask for a snapshot while a batch is open join
+** it, and the first one in (the leader) takes a single snapshot for the
+** whole batch once the window closes.
+*/
+struct AuroraGroupCommit {
+    int fd;                         /* SAS fd being checkpointed */
+    int nRef;                       /* Number of files using this group */
+    pthread_mutex_t mutex;          /* Protects the fields below */
+    pthread_cond_t cond;            /* Signals completion of a batch */
+    sqlite3_uint64 iBatch;          /* Batch currently accepting requests */
+    sqlite3_uint64 iBatchDone;      /* Last batch that was snapshotted */
+    int rcBatch;                    /* Result of the snapshot of iBatchDone */
+    bool bOpen;                     /* Does iBatch have a leader? */
+    bool bCommitting;               /* Is a snapshot in progress? */
+    AuroraGroupCommit *pNext;       /* Next group in auroraGroupList */
+};
+
+/*
+** Checkpoint group, for group=. Checkpoints requested by its files are
+** held back until no file of the group holds a RESERVED or stronger lock,
+** and then taken for all of them at once. The group mutex is held while
+** doing so, which keeps the files from starting new write transactions.
+*/
+struct AuroraCkptGroup {
+    char *zName;                    /* group= of the files */
+    int nRef;                       /* Number of files in the group */
+    int fd;                         /* SAS fd shared by the files */
+    const AuroraBackend *pBackend;  /* Backend shared by the files */
+    pthread_mutex_t mutex;          /* Protects the fields below */
+    AuroraFile *pFiles;             /* Files, linked by pGroupNext */
+    int nWriter;                    /* Files in a write transaction */
+    bool bPending;                  /* Was a checkpoint requested? */
+    AuroraCkptGroup *pNext;         /* Next group in auroraCkptGroupList */
+};
+
+/* All checkpoint groups in the process. */
+static pthread_mutex_t auroraCkptGroupMutex = PTHREAD_MUTEX_INITIALIZER;
+static AuroraCkptGroup *auroraCkptGroupList = NULL;
+
+/*
+** The files opened on the same ptr= region, for AURORA_FCNTL_FREEZE.
+** While the region is frozen, files block before they start to change
+** it, until it is thawed or the freeze expires at iThawUs. That is the
+** start of a write transaction, of a WAL checkpoint, or else the first
+** write. While the freeze makes the files durable, their connections
+** also hold back their own sync mode checkpoints.
+**
+** Checkpointer threads hold writers out the same way while they take
+** their snapshot, so that it falls between transactions.
+*/
+struct AuroraRegion {
+    unsigned char *aData;           /* ptr= of the files */
+    int nRef;                       /* Number of files on the region */
+    pthread_mutex_t mutex;          /* Protects the fields below */
+    pthread_cond_t cond;            /* Signals thaws and ended writes */
+    AuroraFile *pFiles;             /* Files, linked by pRegionNext */
+    int nWriter;                    /* Files changing the region */
+    int nCkpt;                      /* Files in a sync checkpoint */
+    int nHold;                      /* Checkpointers holding writers out */
+    bool bFreezing;                 /* auroraFreeze() checkpointing? */
+    bool bFrozen;                   /* Frozen by AURORA_FCNTL_FREEZE? */
+    sqlite3_int64 iThawUs;          /* When the freeze expires */
+    AuroraRegion *pNext;            /* Next region in auroraRegionList */
+};
+
+/* All regions in the process, keyed by ptr=. */
+static pthread_mutex_t auroraRegionMutex = PTHREAD_MUTEX_INITIALIZER;
+static AuroraRegion *auroraRegionList = NULL;
+
+/*
+** Node of a checkpoint policy expression. Leaves compare the activity
+** since the last checkpoint against iArg; and()/or() nodes combine the
+** list of operands hanging off pChild.
+*/
+struct AuroraPolicy {
+    /* Is a checkpoint due at time iNow (in us) on event eEvent? */
+    bool (*xDue)(AuroraPolicy*, AuroraFile*, int eEvent, sqlite3_int64 iNow);
+    sqlite3_int64 iArg;             /* Parameter of a leaf */
+    AuroraPolicy *pChild;           /* First operand of a composite */
+    AuroraPolicy *pNext;            /* Next operand of the parent */
+};
+
+/*
+** Feedback controller for the adaptive policy. It keeps the durations of
+** the last AURORA_ADAPTIVE_NSAMPLE snapshots, and after each one moves
+** szThreshold so that their p99 approaches nTargetUs: down in proportion
+** to the overshoot, up by an eighth while comfortably under target.
+*/
+struct AuroraAdaptive {
+    sqlite3_int64 nTargetUs;        /* targetCkptUs=, 0 if unset */
+    sqlite3_int64 szTargetRpo;      /* targetRpo=, 0 if unset */
+    sqlite3_int64 szThreshold;      /* Current effective threshold */
+    sqlite3_int64 aSampleUs[AURORA_ADAPTIVE_NSAMPLE]; /* Recent durations */
+    int nSample;                    /* Valid entries in aSampleUs */
+    int iSample;                    /* Next entry to overwrite */
+    sqlite3_int64 nLastUs;          /* Duration of the last snapshot */
+    sqlite3_int64 nP99Us;           /* p99 of aSampleUs */
+    sqlite3_int64 nWriteRate;       /* Moving average of bytes/s written */
+    sqlite3_int64 iLastDoneUs;      /* When the last snapshot completed */
+};
+
+/*
+** How the region of an aurora-file is persisted. xCommit makes a
+** checkpoint durable. Backends that persist the region themselves
+** instead of snapshotting it as a whole also provide either xWrite, which
+** is handed the frozen contents of every dirty range before xCommit, or
+** xAppend, which is handed a record for every dirty page. Both may be
+** called from several flush threads at once.
+*/
+struct AuroraBackend {
+    const char *zName;              /* Name of the backend */
+    int (*xStart)(AuroraFile*);     /* Set up persistence when opening */
+    /* Persist nByte bytes at iOfst of the frozen image, from aData. */
+    int (*xWrite)(AuroraFile*, sqlite3_int64 iOfst, const void *aData, sqlite3_int64 nByte);
+    /* Persist a dirty page of the frozen image as an encoded record. */
+    int (*xAppend)(AuroraFile*, const AuroraPageRec *pRec, const void *aPayload);
+    int (*xCommit)(AuroraFile*);    /* Make the checkpoint durable */
+    void (*xClose)(AuroraFile*);    /* Tear down when closing */
+};
+
+/*
+** Process-wide pool of threads that flush partitions of checkpoints in
+** parallel. It is sized for the file that asked for the most threads,
+** and goes away with the last file using it.
+*/
+struct AuroraFlushPool {
+    pthread_mutex_t mutex;          /* Protects the fields below */
+    pthread_cond_t cond;            /* Signals new jobs or exit */
+    AuroraFlushJob *pJobs;          /* Queue of partitions to flush */
+    pthread_t *aThread;             /* Worker threads */
+    int nThread;                    /* Number of threads in aThread */
+    int nRef;                       /* Number of files using the pool */
+    bool bExit;                     /* Tell the workers to exit */
+};
+
+/*
+** Completion barrier of a parallel flush. The epoch cannot be declared
+** durable before every partition reached it.
+*/
+struct AuroraFlushBarrier {
+    pthread_mutex_t mutex;          /* Protects the fields below */
+    pthread_cond_t cond;            /* Signals the last completion */
+    int nPending;                   /* Partitions still being flushed */
+    int rc;                         /* First error of any partition */
+};
+
+/* One partition of the dirty set, as bitmap words [iLo, iHi). */
+struct AuroraFlushJob {
+    AuroraFile *p;                  /* File being checkpointed */
+    sqlite3_int64 iLo;              /* First bitmap word */
+    sqlite3_int64 iHi;              /* One past the last bitmap word */
+    AuroraFlushBarrier *pBarrier;   /* Barrier to report to */
+    AuroraFlushJob *pNext;          /* Next job in the pool queue */
+};
+
+static AuroraFlushPool auroraFlushPool = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+};
+
+/*
+** A tenant of the process-wide checkpoint scheduler. Tenants take turns
+** by the bytes their checkpoints persisted, divided by their priority.
+*/
+struct AuroraTenant {
+    char *zName;                    /* tenant= of its files, "" if none */
+    int nRef;                       /* Number of open files */
+    sqlite3_int64 nVirtual;         /* Weighted bytes checkpointed */
+    AuroraTenant *pNext;            /* Next tenant of the scheduler */
+};
+
+/* A checkpoint waiting for the scheduler, on the waiter's stack. */
+struct AuroraSchedWaiter {
+    AuroraFile *p;                  /* File to checkpoint */
+    sqlite3_int64 nByte;            /* Bytes written in its epochs */
+    sqlite3_int64 iQueuedUs;        /* Time it was queued */
+    bool bGranted;                  /* Allowed to run? */
+    AuroraSchedWaiter *pNext;       /* Next waiter in the queue */
+};
+
+/*
+** Process-wide scheduler running the checkpoints of all aurora-files,
+** at most nSlot at a time.
+*/
+struct AuroraSched {
+    pthread_mutex_t mutex;          /* Protects the fields below */
+    pthread_cond_t cond;            /* Signals granted checkpoints */
+    int nSlot;                      /* Concurrent checkpoints, 0 for any */
+    int nRunning;                   /* Checkpoints running */
+    int nQueued;                    /* Checkpoints waiting */
+    AuroraSchedWaiter *pQueue;      /* Waiting checkpoints */
+    AuroraTenant *pTenants;         /* Tenants with open files */
+    sqlite3_int64 nVirtual;         /* Tenant's time at the last grant */
+    sqlite3_int64 nGranted;         /* Checkpoints run so far */
+    sqlite3_int64 nWaitUs;          /* Total time spent queued */
+    sqlite3_int64 nMaxWaitUs;       /* Longest time spent queued */
+};
+
+static AuroraSched auroraSched = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+};
+
+#define AURORA_MAX_FLUSH_THREADS 256
+#define AURORA_FLUSH_CHUNK (256 * 1024)
+#define AURORA_MAX_PREFAULT_THREADS 256
+
+/* Part of the region populated by one prefault= thread. */
+struct AuroraPrefaultJob {
+    unsigned char *a;               /* Start, aligned to pages */
+    sqlite3_int64 nByte;            /* Length, a multiple of pages */
+    bool bLock;                     /* mlock() it too? */
+    bool bLocked;                   /* Did mlock() succeed? */
+};
+
+#define AURORA_HOT_CHUNK (64 * 1024)
+#define AURORA_HOT_MAGIC 0x746f6841u    /* "Ahot" */
+
+/*
+** The hot set of a file, for hotset=. Sampled reads mark the chunk they
+** fall in, and the first mark of a chunk appends it to aOrder, which is
+** written to zPath on close. aWarm is what the previous file recorded,
+** which the warm threads prefetch in order.
+**
+** The hot set file is a header of the magic, AURORA_HOT_CHUNK and the
+** number of chunks, as 32-bit words, followed by that many chunk numbers.
+** It is only a hint, so it is neither synced nor checksummed.
+*/
+struct AuroraHot {
+    char *zPath;                    /* hotset= */
+    int nSample;                    /* Record one read in this many */
+    int nTick;                      /* Reads since the last recorded one */
+    sqlite3_uint64 *aSeen;          /* Recorded flag per chunk */
+    sqlite3_int64 nChunk;           /* Chunks up to szMax */
+    pthread_mutex_t mutex;          /* Protects aOrder and nAlloc */
+    uint32_t *aOrder;               /* Chunks in the order first recorded */
+    sqlite3_int64 nOrder;           /* Entries of aOrder */
+    sqlite3_int64 nAlloc;           /* Space in aOrder */
+
+    unsigned char *aData;           /* The region */
+    sqlite3_int64 szWarm;           /* Region size at open */
+    uint32_t *aWarm;                /* Chunks loaded from zPath */
+    sqlite3_int64 nWarm;            /* Entries of aWarm */
+    sqlite3_int64 iWarmNext;        /* Next aWarm entry to prefetch */
+    sqlite3_int64 nWarmDone;        /* Entries of aWarm prefetched */
+    bool bStop;                     /* Set to stop the warm threads */
+    int nThread;                    /* Warm threads running */
+    pthread_t *aThread;             /* The warm threads */
+};
+
+/*
+** Token bucket limiting the bandwidth of checkpoints. Tokens are bytes,
+** refilled at nRate per second up to nBurst. Takers may drive the bucket
+** into debt, which the next takers wait out.
+*/
+struct AuroraBucket {
+    pthread_mutex_t mutex;          /* Protects the fields below */
+    sqlite3_int64 nRate;            /* Bytes per second, 0 for no limit */
+    sqlite3_int64 nBurst;           /* Maximum number of tokens */
+    sqlite3_int64 nToken;           /* Available tokens, may be negative */
+    sqlite3_int64 iLastUs;          /* Time of the last refill */
+};
+
+/*
+** Encodings of the payload of a page record. A delta is a sequence of
+** (zero run, literal run) pairs, both lengths as varints, each followed
+** by the literal bytes to XOR into the previous image of the page. Zero
+** runs at the end of the page are implied.
+*/
+#define AURORA_ENC_RAW      0x00    /* The page itself */
+#define AURORA_ENC_DELTA    0x01    /* XOR against the previous image */
+#define AURORA_ENC_ZSTD     0x10    /* Flag: payload is zstd compressed */
+
+/* A page record as handed to AuroraBackend.xAppend(). */
+struct AuroraPageRec {
+    sqlite3_int64 iOfst;            /* Offset of the page in the region */
+    int nByte;                      /* Size of the page */
+    int eEnc;                       /* AURORA_ENC_* */
+    int nPayload;                   /* Bytes in the encoded payload */
+    int nDelta;                     /* Payload bytes before compression */
+};
+
+/*
+** Record of backend=log: a page record followed by its payload, or with
+** eEnc AURORA_LOG_COMMIT the end of a checkpoint, whose iOfst is the
+** size of the image and iHash covers the records since the last one.
+*/
+#define AURORA_LOG_COMMIT   0x100
+
+struct AuroraLogRec {
+    sqlite3_int64 iOfst;            /* Offset of the page in the region */
+    sqlite3_uint64 iHash;           /* Hash of the checkpoint, if a commit */
+    int nByte;                      /* Size of the page */
+    int eEnc;                       /* AURORA_ENC_* or AURORA_LOG_COMMIT */
+    int nPayload;                   /* Bytes in the encoded payload */
+    int nDelta;                     /* Payload bytes before compression */
+};
+
+/* A pending AURORA_FCNTL_ON_DURABLE callback. */
+struct AuroraDurableWaiter {
+    AuroraDurableCallback cb;       /* Copy of the caller's request */
+    AuroraDurableWaiter *pNext;     /* Next pending callback */
+};
+
+/* All group commit states in the process, keyed by fd. */
+static pthread_mutex_t auroraGroupMutex = PTHREAD_MUTEX_INITIALIZER;
+static AuroraGroupCommit *auroraGroupList = NULL;
+
 /* An open file */
 struct AuroraFile {
     sqlite3_file base;              /* IO methods */
@@ -66,94 +717,4421 @@ struct AuroraFile {
     int isAurMmap;                  /* Should we use Aurora methods or fallback to underlying VFS? */
     char *fileName;                 /* Name of file */
     sqlite_int64 szWritten;	    /* Bytes written since last snapshot */
-    sqlite_uint64 szThreshold;	    /* Checkpointing threshold */
-    bool bCkptOnSync;	    	    /* Checkpoint on xSync()? */
+    bool bCkptPending;              /* Policy fired, checkpoint at commit */
     int fd;                         /* Aurora SAS fd */
+    char *zImage;                   /* backendPath= of the file backends */
+    int fdImage;                    /* Open backendPath=, or -1 */
+    AuroraUring *pUring;            /* State of backend=uring */
+    sqlite3_int64 szForkMax;        /* forkMax= of backend=fork */
+    bool bPmemDax;                  /* pmemDax= of backend=pmem */
+    AuroraLog *pLog;                /* State of backend=log */
+    sqlite3_int64 szLogMax;         /* logMax= of backend=log */
+    bool bRestored;                 /* Region restored from the image? */
+    AuroraRestore *pRestore;        /* Lazy restore in progress */
+    AuroraPrefaultStats prefault;   /* What prefault= did */
+    AuroraHot *pHot;                /* hotset= recording and warm start */
+    int eLock;                      /* Current SQLITE_LOCK_* level */
+    /* Checkpoint policy and the activity it looks at. */
+    AuroraPolicy *pPolicy;          /* When to checkpoint, NULL for never */
+    sqlite3_int64 nCommit;          /* Transactions since last snapshot */
+    sqlite3_int64 iLastCkptUs;      /* Time of the last snapshot */
+    sqlite3_int64 iLastWriteUs;     /* Time of the last write */
+    sqlite3_int64 nTickUs;          /* Poll interval of time policies */
+    sqlite3_int64 szClosed;         /* Bytes in closed, unpersisted epochs */
+    AuroraAdaptive adapt;           /* State of the adaptive policy */
+    const AuroraBackend *pBackend;  /* How the region is persisted */
+    int nFlushThread;               /* Threads flushing a checkpoint */
+    AuroraBucket bucket;            /* Checkpoint bandwidth limit */
+    sqlite3_int64 szHighWater;      /* Throttle writers above this */
+    AuroraTenant *pTenant;          /* Scheduler tenant */
+    int nCkptPriority;              /* Scheduler weight */
+    sqlite3_int64 nSchedWaitUs;     /* Last time spent queued */
+    AuroraCkptGroup *pCkptGroup;    /* Checkpoint group, if any */
+    AuroraFile *pGroupNext;         /* Next file in the group */
+    bool bGroupWriter;              /* Counted in pCkptGroup->nWriter? */
+    bool bInCkpt;                   /* Part of the running checkpoint? */
+    AuroraRegion *pRegion;          /* Files sharing the region */
+    AuroraFile *pRegionNext;        /* Next file on the region */
+    bool bRegionWriter;             /* Counted in pRegion->nWriter? */
+    bool bRegionHeld;               /* Counted in pRegion->nHold? */
+    bool bOverwrite;                /* Being overwritten, e.g. by VACUUM */
+    bool bWalCkpt;                  /* WAL checkpoint in progress? */
+    int eCkptMode;                  /* AURORA_CKPT_SYNC or AURORA_CKPT_ASYNC */
+    /*
+     * Checkpoint epochs. Each checkpoint closes the open epoch iEpoch+1,
+     * and iEpochDone is the last one it made durable. In async mode the
+     * checkpointer thread makes epochs durable in the background.
+     */
+    pthread_t ckptThread;           /* Background checkpointer */
+    pthread_mutex_t ckptMutex;      /* Protects the fields below */
+    pthread_cond_t ckptWork;        /* Signals the checkpointer */
+    pthread_cond_t ckptDone;        /* Signals waiters on a checkpoint */
+    sqlite3_uint64 iEpoch;          /* Last closed epoch */
+    sqlite3_uint64 iEpochDone;      /* Last durable epoch */
+    sqlite3_uint64 nMaxLag;         /* Epochs writers may run ahead */
+    sqlite3_int64 szUndurable;      /* Bytes written but not durable */
+    int ckptRc;                     /* Error of the last checkpoint */
+    bool bCkptExit;                 /* Tell the checkpointer to exit */
+    AuroraDurableWaiter *pWaiters;  /* Pending durability callbacks */
+    AuroraGroupCommit *pGroup;      /* Group commit state, if enabled */
+    sqlite3_uint64 nGroupCommitUs;  /* Group commit window */
+    /*
+     * Dirty page tracking. Writes are recorded in pDirty. A checkpoint
+     * freezes the set by swapping it with pCkptDirty, which is then what
+     * the checkpoint has to persist; szCkpt is the file size at that time.
+     * Pages that copy-on-write lets leave pCkptDirty early are kept in
+     * pCkptDone, in case the checkpoint fails and has to be retried.
+     */
+    int szDirtyPg;                  /* Tracking granularity, 0 if disabled */
+    int nDirtyShift;                /* log2(szDirtyPg) */
+    sqlite3_int64 nDirtyWord;       /* Words in each bitmap */
+    AuroraDirtyMap aDirtyMap[3];    /* Backing storage for the sets */
+    AuroraDirtyMap *pDirty;         /* Pages written since the last freeze */
+    AuroraDirtyMap *pCkptDirty;     /* Pages being checkpointed */
+    AuroraDirtyMap *pCkptDone;      /* Pages checkpointed, not durable yet */
+    sqlite3_int64 szCkpt;           /* File size when pCkptDirty was frozen */
+    bool bSkipSame;                 /* Skip writes that change nothing */
+    sqlite3_uint64 *aPageHash;      /* Durable page hashes, 0 if unknown */
+    bool bDelta;                    /* Delta-encode page records */
+    bool bCompress;                 /* Compress page records */
+    unsigned char **apBase;         /* Last persisted image of each page */
+    /*
+     * Copy-on-write of frozen pages, async mode only. While bFrozen is
+     * set, the first write to a page still in pCkptDirty saves its old
+     * contents in aShadow. Pages leave pCkptDirty once persisted.
+     */
+    bool bCow;                      /* Copy-on-write enabled? */
+    bool bFrozen;                   /* Checkpoint in progress? */
+    AuroraShadow *aShadow;          /* Hash table of saved pages */
+    int nShadowSlot;                /* Slots in aShadow, a power of two */
+    int nShadow;                    /* Used slots in aShadow */
+};
+
+/*
+** Methods for AuroraFile
+*/
+static int auroraClose(sqlite3_file*);
+static int auroraRead(sqlite3_file*, void*, int iAmt, sqlite3_int64 iOfst);
+static int auroraWrite(sqlite3_file*,const void*,int iAmt, sqlite3_int64 iOfst);
+static int auroraTruncate(sqlite3_file*, sqlite3_int64 size);
+static int auroraSync(sqlite3_file*, int flags);
+static int auroraFileSize(sqlite3_file*, sqlite3_int64 *pSize);
+static int auroraLock(sqlite3_file*, int);
+static int auroraUnlock(sqlite3_file*, int);
+static int auroraCheckReservedLock(sqlite3_file*, int *pResOut);
+static int auroraFileControl(sqlite3_file*, int op, void *pArg);
+static int auroraSectorSize(sqlite3_file*);
+static int auroraDeviceCharacteristics(sqlite3_file*);
+static int auroraShmMap(sqlite3_file*, int iPg, int pgsz, int, void volatile**);
+static int auroraShmLock(sqlite3_file*, int offset, int n, int flags);
+static void auroraShmBarrier(sqlite3_file*);
+static int auroraShmUnmap(sqlite3_file*, int deleteFlag);
+static int auroraFetch(sqlite3_file*, sqlite3_int64 iOfst, int iAmt, void **pp);
+static int auroraUnfetch(sqlite3_file*, sqlite3_int64 iOfst, void *p);
+
+/*
+** Methods for AuroraVfs
+*/
+static int auroraOpen(sqlite3_vfs*, const char *, sqlite3_file*, int , int *);
+static int auroraDelete(sqlite3_vfs*, const char *zName, int syncDir);
+static int auroraAccess(sqlite3_vfs*, const char *zName, int flags, int *);
+static int auroraFullPathname(sqlite3_vfs*, const char *zName, int, char *zOut);
+static void *auroraDlOpen(sqlite3_vfs*, const char *zFilename);
+static void auroraDlError(sqlite3_vfs*, int nByte, char *zErrMsg);
+static void (*auroraDlSym(sqlite3_vfs *pVfs, void *p, const char*zSym))(void);
+static void auroraDlClose(sqlite3_vfs*, void*);
+static int auroraRandomness(sqlite3_vfs*, int nByte, char *zOut);
+static int auroraSleep(sqlite3_vfs*, int microseconds);
+static int auroraCurrentTime(sqlite3_vfs*, double*);
+static int auroraGetLastError(sqlite3_vfs*, int, char *);
+static int auroraCurrentTimeInt64(sqlite3_vfs*, sqlite3_int64*);
+
+static sqlite3_vfs aurora_vfs = {
+        2,                           /* iVersion */
+        0,                           /* szOsFile (set when registered) */
+        1024,                        /* mxPathname */
+        0,                           /* pNext */
+        "auroravfs",                    /* zName */
+        0,                           /* pAppData (set when registered) */
+        auroraOpen,                     /* xOpen */
+        auroraDelete,                   /* xDelete */
+        auroraAccess,                   /* xAccess */
+        auroraFullPathname,             /* xFullPathname */
+        auroraDlOpen,                   /* xDlOpen */
+        auroraDlError,                  /* xDlError */
+        auroraDlSym,                    /* xDlSym */
+        auroraDlClose,                  /* xDlClose */
+        auroraRandomness,               /* xRandomness */
+        auroraSleep,                    /* xSleep */
+        auroraCurrentTime,              /* xCurrentTime */
+        auroraGetLastError,             /* xGetLastError */
+        auroraCurrentTimeInt64          /* xCurrentTimeInt64 */
+};
+
+static const sqlite3_io_methods aurora_io_methods = {
+        3,                              /* iVersion */
+        auroraClose,                      /* xClose */
+        auroraRead,                       /* xRead */
+        auroraWrite,                      /* xWrite */
+        auroraTruncate,                   /* xTruncate */
+        auroraSync,                       /* xSync */
+        auroraFileSize,                   /* xFileSize */
+        auroraLock,                       /* xLock */
+        auroraUnlock,                     /* xUnlock */
+        auroraCheckReservedLock,          /* xCheckReservedLock */
+        auroraFileControl,                /* xFileControl */
+        auroraSectorSize,                 /* xSectorSize */
+        auroraDeviceCharacteristics,      /* xDeviceCharacteristics */
+        auroraShmMap,                     /* xShmMap */
+        auroraShmLock,                    /* xShmLock */
+        auroraShmBarrier,                 /* xShmBarrier */
+        auroraShmUnmap,                   /* xShmUnmap */
+        auroraFetch,                      /* xFetch */
+        auroraUnfetch                     /* xUnfetch */
 };
 
+
+/*
+** Current time in microseconds, for checkpoint policies.
+*/
+static sqlite3_int64 auroraNowUs(void){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (sqlite3_int64)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+** In async mode the checkpointing state of an aurora-file is shared with
+** the checkpointer thread and protected by ckptMutex. In sync mode only
+** the connection touches it, so there is nothing to lock.
+*/
+static void auroraCkptLock(AuroraFile *p){
+    if (p->eCkptMode == AURORA_CKPT_ASYNC)
+	pthread_mutex_lock(&p->ckptMutex);
+}
+
+static void auroraCkptUnlock(AuroraFile *p){
+    if (p->eCkptMode == AURORA_CKPT_ASYNC)
+	pthread_mutex_unlock(&p->ckptMutex);
+}
+
+/*
+** Wait on a condition variable for at most nUs microseconds.
+*/
+static void auroraCondWaitUs(pthread_cond_t *pCond, pthread_mutex_t *pMutex, sqlite3_int64 nUs){
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += nUs / 1000000;
+    ts.tv_nsec += (nUs % 1000000) * 1000;
+    if (ts.tv_nsec >= 1000000000) {
+	ts.tv_sec += 1;
+	ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(pCond, pMutex, &ts);
+}
+
+/*
+** Count an aurora-file as changing its region, waiting for as long as
+** the region is frozen or held first. A no-op if it is counted already.
+*/
+static void auroraRegionWriteBegin(AuroraFile *p){
+    AuroraRegion *pRegion = p->pRegion;
+    sqlite3_int64 iNow;
+
+    if (p->bRegionWriter)
+	return;
+
+    pthread_mutex_lock(&pRegion->mutex);
+    for (;;) {
+	iNow = auroraNowUs();
+	if (pRegion->bFrozen && iNow < pRegion->iThawUs)
+	    auroraCondWaitUs(&pRegion->cond, &pRegion->mutex, pRegion->iThawUs - iNow);
+	else if (pRegion->nHold > 0)
+	    pthread_cond_wait(&pRegion->cond, &pRegion->mutex);
+	else
+	    break;
+    }
+    pRegion->nWriter += 1;
+    p->bRegionWriter = true;
+    pthread_mutex_unlock(&pRegion->mutex);
+}
+
+static void auroraRegionWriteEnd(AuroraFile *p){
+    AuroraRegion *pRegion = p->pRegion;
+
+    if (!p->bRegionWriter)
+	return;
+
+    pthread_mutex_lock(&pRegion->mutex);
+    pRegion->nWriter -= 1;
+    pthread_cond_broadcast(&pRegion->cond);
+    p->bRegionWriter = false;
+    pthread_mutex_unlock(&pRegion->mutex);
+}
+
+/*
+** Keep new writers out of the region of an aurora-file and wait for the
+** running ones to end, so that it stays at a transaction boundary until
+** auroraRegionUnhold(). For checkpointer threads, which do not write.
+*/
+static void auroraRegionHold(AuroraFile *p){
+    AuroraRegion *pRegion = p->pRegion;
+
+    pthread_mutex_lock(&pRegion->mutex);
+    pRegion->nHold += 1;
+    while (pRegion->nWriter > 0)
+	pthread_cond_wait(&pRegion->cond, &pRegion->mutex);
+    pthread_mutex_unlock(&pRegion->mutex);
+    p->bRegionHeld = true;
+}
+
+static void auroraRegionUnhold(AuroraFile *p){
+    AuroraRegion *pRegion = p->pRegion;
+
+    if (!p->bRegionHeld)
+	return;
+
+    pthread_mutex_lock(&pRegion->mutex);
+    pRegion->nHold -= 1;
+    pthread_cond_broadcast(&pRegion->cond);
+    pthread_mutex_unlock(&pRegion->mutex);
+    p->bRegionHeld = false;
+}
+
+/*
+** Bracket a sync mode checkpoint that the connection of an aurora-file
+** takes itself, so that it does not run while auroraFreeze() takes one
+** for it.
+*/
+static void auroraRegionCkptBegin(AuroraFile *p){
+    AuroraRegion *pRegion = p->pRegion;
+
+    pthread_mutex_lock(&pRegion->mutex);
+    while (pRegion->bFreezing)
+	pthread_cond_wait(&pRegion->cond, &pRegion->mutex);
+    pRegion->nCkpt += 1;
+    pthread_mutex_unlock(&pRegion->mutex);
+}
+
+static void auroraRegionCkptEnd(AuroraFile *p){
+    AuroraRegion *pRegion = p->pRegion;
+
+    pthread_mutex_lock(&pRegion->mutex);
+    pRegion->nCkpt -= 1;
+    pthread_cond_broadcast(&pRegion->cond);
+    pthread_mutex_unlock(&pRegion->mutex);
+}
+
+static bool auroraPolicySync(AuroraPolicy *pPolicy, AuroraFile *p, int eEvent, sqlite3_int64 iNow){
+    return eEvent == AURORA_EV_SYNC && p->szWritten > 0;
+}
+
+static bool auroraPolicyBytes(AuroraPolicy *pPolicy, AuroraFile *p, int eEvent, sqlite3_int64 iNow){
+    return p->szWritten > pPolicy->iArg;
+}
+
+static bool auroraPolicyAdaptive(AuroraPolicy *pPolicy, AuroraFile *p, int eEvent, sqlite3_int64 iNow){
+    return p->szWritten > p->adapt.szThreshold;
+}
+
+static bool auroraPolicyCommits(AuroraPolicy *pPolicy, AuroraFile *p, int eEvent, sqlite3_int64 iNow){
+    return p->szWritten > 0 && p->nCommit >= pPolicy->iArg;
+}
+
+static bool auroraPolicyTime(AuroraPolicy *pPolicy, AuroraFile *p, int eEvent, sqlite3_int64 iNow){
+    return p->szWritten > 0 && iNow - p->iLastCkptUs >= pPolicy->iArg * 1000;
+}
+
+static bool auroraPolicyIdle(AuroraPolicy *pPolicy, AuroraFile *p, int eEvent, sqlite3_int64 iNow){
+    return eEvent == AURORA_EV_TICK && p->szWritten > 0 &&
+	iNow - p->iLastWriteUs >= pPolicy->iArg * 1000;
+}
+
+static bool auroraPolicyAnd(AuroraPolicy *pPolicy, AuroraFile *p, int eEvent, sqlite3_int64 iNow){
+    AuroraPolicy *pChild;
+
+    for (pChild = pPolicy->pChild; pChild != NULL; pChild = pChild->pNext) {
+	if (!pChild->xDue(pChild, p, eEvent, iNow))
+	    return false;
+    }
+
+    return true;
+}
+
+static bool auroraPolicyOr(AuroraPolicy *pPolicy, AuroraFile *p, int eEvent, sqlite3_int64 iNow){
+    AuroraPolicy *pChild;
+
+    for (pChild = pPolicy->pChild; pChild != NULL; pChild = pChild->pNext) {
+	if (pChild->xDue(pChild, p, eEvent, iNow))
+	    return true;
+    }
+
+    return false;
+}
+
+/* The policies that can appear in a policy= expression. */
+static const struct {
+    const char *zName;
+    bool (*xDue)(AuroraPolicy*, AuroraFile*, int, sqlite3_int64);
+    bool bArg;                      /* Takes a :N argument? */
+    bool bComposite;                /* Takes a list of policies? */
+} auroraPolicyTypes[] = {
+    { "sync",    auroraPolicySync,    false, false },
+    { "bytes",   auroraPolicyBytes,   true,  false },
+    { "commits", auroraPolicyCommits, true,  false },
+    { "time",    auroraPolicyTime,    true,  false },
+    { "idle",    auroraPolicyIdle,    true,  false },
+    { "and",     auroraPolicyAnd,     false, true  },
+    { "or",      auroraPolicyOr,      false, true  },
+    { "adaptive", auroraPolicyAdaptive, false, false },
+};
+
+static void auroraPolicyFree(AuroraPolicy *pPolicy){
+    AuroraPolicy *pNext;
+
+    while (pPolicy != NULL) {
+	pNext = pPolicy->pNext;
+	auroraPolicyFree(pPolicy->pChild);
+	sqlite3_free(pPolicy);
+	pPolicy = pNext;
+    }
+}
+
+static AuroraPolicy *auroraPolicyNew(bool (*xDue)(AuroraPolicy*, AuroraFile*, int, sqlite3_int64), sqlite3_int64 iArg){
+    AuroraPolicy *pPolicy;
+
+    pPolicy = sqlite3_malloc(sizeof(*pPolicy));
+    if (pPolicy == NULL)
+	return NULL;
+
+    memset(pPolicy, 0, sizeof(*pPolicy));
+    pPolicy->xDue = xDue;
+    pPolicy->iArg = iArg;
+
+    return pPolicy;
+}
+
+/*
+** Parse the policy expression at *pz, advancing *pz past it. Returns NULL
+** on a syntax error or OOM.
+*/
+static AuroraPolicy *auroraPolicyParse(const char **pz){
+    AuroraPolicy *pPolicy, **ppChild;
+    const char *z = *pz;
+    char *zEnd;
+    size_t n;
+    int i;
+
+    for (i = 0; i < (int)(sizeof(auroraPolicyTypes) / sizeof(auroraPolicyTypes[0])); i++) {
+	n = strlen(auroraPolicyTypes[i].zName);
+	if (strncmp(z, auroraPolicyTypes[i].zName, n) == 0 &&
+	    strchr(":(,)", z[n]) != NULL)
+	    break;
+    }
+    if (i == (int)(sizeof(auroraPolicyTypes) / sizeof(auroraPolicyTypes[0])))
+	return NULL;
+
+    pPolicy = auroraPolicyNew(auroraPolicyTypes[i].xDue, 0);
+    if (pPolicy == NULL)
+	return NULL;
+    z += n;
+
+    if (auroraPolicyTypes[i].bArg) {
+	if (*z != ':')
+	    goto error;
+	pPolicy->iArg = strtoll(z + 1, &zEnd, 0);
+	if (zEnd == z + 1 || pPolicy->iArg < 0)
+	    goto error;
+	z = zEnd;
+    }
+
+    if (auroraPolicyTypes[i].bComposite) {
+	if (*z != '(')
+	    goto error;
+
+	ppChild = &pPolicy->pChild;
+	do {
+	    z += 1;
+	    *ppChild = auroraPolicyParse(&z);
+	    if (*ppChild == NULL)
+		goto error;
+	    ppChild = &(*ppChild)->pNext;
+	} while (*z == ',');
+
+	if (*z != ')')
+	    goto error;
+	z += 1;
+    }
+
+    *pz = z;
+    return pPolicy;
+
+error:
+    auroraPolicyFree(pPolicy);
+    return NULL;
+}
+
+/*
+** Interval at which the checkpointer polls the time-based policies of an
+** expression, twice per shortest interval, or 0 if there are none.
+*/
+static sqlite3_int64 auroraPolicyTickUs(AuroraPolicy *pPolicy){
+    sqlite3_int64 nTick = 0, nChild;
+
+    for (; pPolicy != NULL; pPolicy = pPolicy->pNext) {
+	if (pPolicy->xDue == auroraPolicyTime || pPolicy->xDue == auroraPolicyIdle)
+	    nChild = pPolicy->iArg > 0 ? pPolicy->iArg * 500 : 1000;
+	else
+	    nChild = auroraPolicyTickUs(pPolicy->pChild);
+
+	if (nChild > 0 && (nTick == 0 || nChild < nTick))
+	    nTick = nChild;
+    }
+
+    return nTick;
+}
+
+/*
+** Does a policy expression use the leaf policy xDue?
+*/
+static bool auroraPolicyHas(AuroraPolicy *pPolicy, bool (*xDue)(AuroraPolicy*, AuroraFile*, int, sqlite3_int64)){
+    for (; pPolicy != NULL; pPolicy = pPolicy->pNext) {
+	if (pPolicy->xDue == xDue || auroraPolicyHas(pPolicy->pChild, xDue))
+	    return true;
+    }
+
+    return false;
+}
+
+/*
+** Set up the adaptive threshold controller, if targetCkptUs= or
+** targetRpo= ask for it. A disabled controller has a 0 threshold.
+*/
+static void auroraAdaptiveInit(AuroraFile *p, const char *zName){
+    AuroraAdaptive *pAdapt = &p->adapt;
+
+    memset(pAdapt, 0, sizeof(*pAdapt));
+    pAdapt->nTargetUs = sqlite3_uri_int64(zName, "targetCkptUs", 0);
+    pAdapt->szTargetRpo = sqlite3_uri_int64(zName, "targetRpo", 0);
+    if (pAdapt->nTargetUs <= 0 && pAdapt->szTargetRpo <= 0)
+	return;
+
+    pAdapt->szThreshold = sqlite3_uri_int64(zName, "threshold", AURORA_ADAPTIVE_INIT);
+    if (pAdapt->nTargetUs <= 0 || pAdapt->szThreshold <= 0)
+	pAdapt->szThreshold = pAdapt->szTargetRpo > 0 ? pAdapt->szTargetRpo : AURORA_ADAPTIVE_INIT;
+    if (pAdapt->szTargetRpo > 0 && pAdapt->szThreshold > pAdapt->szTargetRpo)
+	pAdapt->szThreshold = pAdapt->szTargetRpo;
+
+    pAdapt->iLastDoneUs = auroraNowUs();
+}
+
+static int auroraCompareInt64(const void *pA, const void *pB){
+    sqlite3_int64 a = *(const sqlite3_int64 *)pA;
+    sqlite3_int64 b = *(const sqlite3_int64 *)pB;
+
+    return (a > b) - (a < b);
+}
+
+/*
+** Feed the duration of a snapshot that persisted nByte bytes to the
+** adaptive threshold controller.
+*/
+static void auroraAdaptiveRecord(AuroraFile *p, sqlite3_int64 nByte, sqlite3_int64 nUs){
+    sqlite3_int64 aSorted[AURORA_ADAPTIVE_NSAMPLE];
+    AuroraAdaptive *pAdapt = &p->adapt;
+    sqlite3_int64 iNow = auroraNowUs();
+    sqlite3_int64 szNew, nRate;
+
+    if (pAdapt->szThreshold == 0)
+	return;
+
+    auroraCkptLock(p);
+
+    pAdapt->nLastUs = nUs;
+    pAdapt->aSampleUs[pAdapt->iSample] = nUs;
+    pAdapt->iSample = (pAdapt->iSample + 1) % AURORA_ADAPTIVE_NSAMPLE;
+    if (pAdapt->nSample < AURORA_ADAPTIVE_NSAMPLE)
+	pAdapt->nSample += 1;
+
+    memcpy(aSorted, pAdapt->aSampleUs, pAdapt->nSample * sizeof(aSorted[0]));
+    qsort(aSorted, pAdapt->nSample, sizeof(aSorted[0]), auroraCompareInt64);
+    pAdapt->nP99Us = aSorted[(pAdapt->nSample * 99 - 1) / 100];
+
+    if (iNow > pAdapt->iLastDoneUs) {
+	nRate = nByte * 1000000 / (iNow - pAdapt->iLastDoneUs);
+	pAdapt->nWriteRate = (pAdapt->nWriteRate * 3 + nRate) / 4;
+    }
+    pAdapt->iLastDoneUs = iNow;
+
+    szNew = pAdapt->szThreshold;
+    if (pAdapt->nTargetUs > 0) {
+	if (pAdapt->nP99Us > pAdapt->nTargetUs) {
+	    szNew = szNew * pAdapt->nTargetUs / pAdapt->nP99Us;
+	    if (szNew < pAdapt->szThreshold / 2)
+		szNew = pAdapt->szThreshold / 2;
+	} else if (pAdapt->nP99Us < pAdapt->nTargetUs * 9 / 10) {
+	    szNew += szNew / 8;
+	}
+    }
+
+    if (pAdapt->szTargetRpo > 0 && szNew > pAdapt->szTargetRpo)
+	szNew = pAdapt->szTargetRpo;
+    if (szNew < AURORA_ADAPTIVE_MIN)
+	szNew = AURORA_ADAPTIVE_MIN;
+    pAdapt->szThreshold = szNew;
+
+    auroraCkptUnlock(p);
+}
+
+/*
+** Build the checkpoint policy of an aurora-file from its URI. Without a
+** policy= parameter, threshold= and ckptOnSync= keep their old meaning.
+*/
+static int auroraPolicyInit(AuroraFile *p, const char *zName){
+    const char *zPolicy = sqlite3_uri_parameter(zName, "policy");
+    sqlite3_int64 szThreshold;
+    AuroraPolicy **ppChild;
+
+    auroraAdaptiveInit(p, zName);
+
+    if (zPolicy != NULL) {
+	p->pPolicy = auroraPolicyParse(&zPolicy);
+	if (p->pPolicy == NULL || *zPolicy != '\0')
+	    return SQLITE_CANTOPEN;
+    } else {
+	p->pPolicy = auroraPolicyNew(auroraPolicyOr, 0);
+	if (p->pPolicy == NULL)
+	    return SQLITE_NOMEM;
+	ppChild = &p->pPolicy->pChild;
+
+	/*
+	 * Threshold can be 0, in which case writes
+	 * do not trigger checkpointing at all.
+	 */
+	szThreshold = sqlite3_uri_int64(zName, "threshold", 0);
+	if (p->adapt.szThreshold > 0) {
+	    *ppChild = auroraPolicyNew(auroraPolicyAdaptive, 0);
+	    if (*ppChild == NULL)
+		return SQLITE_NOMEM;
+	    ppChild = &(*ppChild)->pNext;
+	} else if (szThreshold > 0) {
+	    *ppChild = auroraPolicyNew(auroraPolicyBytes, szThreshold);
+	    if (*ppChild == NULL)
+		return SQLITE_NOMEM;
+	    ppChild = &(*ppChild)->pNext;
+	}
+
+	/*
+	 * Configure triggering checkpointing on xSync.
+	 * The default is to keep checkpointing on.
+	 */
+	if (sqlite3_uri_int64(zName, "ckptOnSync", 1) > 0) {
+	    *ppChild = auroraPolicyNew(auroraPolicySync, 0);
+	    if (*ppChild == NULL)
+		return SQLITE_NOMEM;
+	}
+    }
+
+    /* The adaptive policy needs the controller. */
+    if (p->adapt.szThreshold == 0 && auroraPolicyHas(p->pPolicy, auroraPolicyAdaptive))
+	return SQLITE_CANTOPEN;
+
+    /* Nobody would ever notice an idle file in sync mode. */
+    if (p->eCkptMode == AURORA_CKPT_SYNC && auroraPolicyHas(p->pPolicy, auroraPolicyIdle))
+	return SQLITE_CANTOPEN;
+
+    if (p->eCkptMode == AURORA_CKPT_ASYNC)
+	p->nTickUs = auroraPolicyTickUs(p->pPolicy);
+
+    p->iLastCkptUs = p->iLastWriteUs = auroraNowUs();
+
+    return SQLITE_OK;
+}
+
+/*
+** Feed an event to the checkpoint policy of an aurora-file. Returns true
+** if a checkpoint is due right away. Writes never checkpoint by
+** themselves; a policy firing on a write defers the checkpoint to the
+** end of the transaction, so that we never snapshot a half-written
+** database. In async mode the caller must hold ckptMutex.
+*/
+static bool auroraPolicyEvent(AuroraFile *p, int eEvent, sqlite3_int64 nByte){
+    sqlite3_int64 iNow = auroraNowUs();
+    bool bDue;
+
+    if (eEvent == AURORA_EV_WRITE) {
+	p->szWritten += nByte;
+	p->iLastWriteUs = iNow;
+    } else if (eEvent == AURORA_EV_COMMIT) {
+	p->nCommit += 1;
+    }
+
+    /* Full overwrites and WAL checkpoints are checkpointed once over. */
+    if (p->bOverwrite || p->bWalCkpt)
+	return false;
+
+    bDue = p->pPolicy != NULL && p->pPolicy->xDue(p->pPolicy, p, eEvent, iNow);
+
+    switch (eEvent) {
+    case AURORA_EV_WRITE:
+	if (bDue)
+	    p->bCkptPending = true;
+	return false;
+
+    case AURORA_EV_COMMIT:
+	return (bDue || p->bCkptPending) && p->szWritten > 0;
+
+    case AURORA_EV_TICK:
+	/* Only checkpoint between transactions. */
+	return bDue && p->eLock < SQLITE_LOCK_RESERVED;
+
+    default:
+	return bDue;
+    }
+}
+
+/*
+** Start a new epoch after a checkpoint was decided on. In async mode the
+** caller must hold ckptMutex.
+*/
+static void auroraEpochClose(AuroraFile *p){
+    p->iEpoch += 1;
+    p->szClosed += p->szWritten;
+    p->szWritten = 0;
+    p->nCommit = 0;
+    p->bCkptPending = false;
+    p->iLastCkptUs = auroraNowUs();
+}
+
+/*
+** Allocate the dirty page bitmaps of an aurora-file. Pages are tracked at
+** szDirtyPg granularity over the whole of aData, up to szMax.
+*/
+static int auroraDirtyInit(AuroraFile *p, int szDirtyPg){
+    sqlite3_int64 nPage;
+    int i;
+
+    if (szDirtyPg == 0)
+	return SQLITE_OK;
+
+    if (szDirtyPg < 0 || (szDirtyPg & (szDirtyPg - 1)) != 0)
+	return SQLITE_CANTOPEN;
+
+    p->szDirtyPg = szDirtyPg;
+    p->nDirtyShift = __builtin_ctz(szDirtyPg);
+    nPage = (p->szMax + szDirtyPg - 1) >> p->nDirtyShift;
+
+    /* Even an empty region gets a word, as allocating 0 bytes fails. */
+    p->nDirtyWord = nPage > 0 ? (nPage + 63) / 64 : 1;
+
+    for (i = 0; i < 3; i++) {
+	p->aDirtyMap[i].aBit = sqlite3_malloc64(p->nDirtyWord * sizeof(sqlite3_uint64));
+	if (p->aDirtyMap[i].aBit == NULL)
+	    return SQLITE_NOMEM;
+
+	memset(p->aDirtyMap[i].aBit, 0, p->nDirtyWord * sizeof(sqlite3_uint64));
+	p->aDirtyMap[i].iLo = p->nDirtyWord;
+	p->aDirtyMap[i].iHi = 0;
+    }
+
+    p->pDirty = &p->aDirtyMap[0];
+    p->pCkptDirty = &p->aDirtyMap[1];
+    p->pCkptDone = &p->aDirtyMap[2];
+
+    return SQLITE_OK;
+}
+
+static void auroraDirtyFree(AuroraFile *p){
+    sqlite3_free(p->aDirtyMap[0].aBit);
+    sqlite3_free(p->aDirtyMap[1].aBit);
+    sqlite3_free(p->aDirtyMap[2].aBit);
+    sqlite3_free(p->aPageHash);
+    p->aPageHash = NULL;
+    memset(p->aDirtyMap, 0, sizeof(p->aDirtyMap));
+    p->pDirty = p->pCkptDirty = p->pCkptDone = NULL;
+    p->szDirtyPg = 0;
+}
+
+static void auroraDirtySet(AuroraDirtyMap *pMap, sqlite3_int64 iPg){
+    sqlite3_uint64 mask = 1ULL << (iPg & 63);
+
+    if ((pMap->aBit[iPg / 64] & mask) != 0)
+	return;
+
+    pMap->aBit[iPg / 64] |= mask;
+    pMap->nPage += 1;
+    if (iPg / 64 < pMap->iLo)
+	pMap->iLo = iPg / 64;
+    if (iPg / 64 >= pMap->iHi)
+	pMap->iHi = iPg / 64 + 1;
+}
+
+/*
+** Record that bytes [iOfst, iOfst + nByte) of an aurora-file changed.
+** In async mode the caller must hold ckptMutex.
+*/
+static void auroraDirtyMark(AuroraFile *p, sqlite3_int64 iOfst, sqlite3_int64 nByte){
+    sqlite3_int64 iPg, iLast;
+
+    if (p->szDirtyPg == 0 || nByte <= 0)
+	return;
+
+    iLast = (iOfst + nByte - 1) >> p->nDirtyShift;
+    for (iPg = iOfst >> p->nDirtyShift; iPg <= iLast; iPg++)
+	auroraDirtySet(p->pDirty, iPg);
+}
+
+/*
+** Add the pages of pMap to those written since the last freeze. In async
+** mode the caller must hold ckptMutex.
+*/
+static void auroraDirtyMerge(AuroraFile *p, AuroraDirtyMap *pMap){
+    AuroraDirtyMap *pDirty = p->pDirty;
+    sqlite3_int64 iWord;
+    sqlite3_uint64 w;
+
+    for (iWord = pMap->iLo; iWord < pMap->iHi; iWord++) {
+	w = pMap->aBit[iWord] & ~pDirty->aBit[iWord];
+	if (w == 0)
+	    continue;
+
+	pDirty->aBit[iWord] |= w;
+	pDirty->nPage += __builtin_popcountll(w);
+	if (iWord < pDirty->iLo)
+	    pDirty->iLo = iWord;
+	if (iWord >= pDirty->iHi)
+	    pDirty->iHi = iWord + 1;
+    }
+}
+
+static void auroraDirtyReset(AuroraFile *p, AuroraDirtyMap *pMap){
+    if (pMap->iLo >= pMap->iHi)
+	return;
+
+    memset(&pMap->aBit[pMap->iLo], 0,
+	    (pMap->iHi - pMap->iLo) * sizeof(sqlite3_uint64));
+    pMap->iLo = p->nDirtyWord;
+    pMap->iHi = 0;
+    pMap->nPage = 0;
+}
+
+static bool auroraDirtyTest(AuroraDirtyMap *pMap, sqlite3_int64 iPg){
+    return (pMap->aBit[iPg / 64] & (1ULL << (iPg & 63))) != 0;
+}
+
+static void auroraDirtyClear(AuroraDirtyMap *pMap, sqlite3_int64 iPg){
+    if (!auroraDirtyTest(pMap, iPg))
+	return;
+
+    pMap->aBit[iPg / 64] &= ~(1ULL << (iPg & 63));
+    pMap->nPage -= 1;
+}
+
+static AuroraShadow *auroraShadowFind(AuroraFile *p, sqlite3_int64 iPg){
+    unsigned int i;
+
+    if (p->nShadowSlot == 0)
+	return NULL;
+
+    i = (unsigned int)(iPg * 0x9E3779B1u) & (p->nShadowSlot - 1);
+    while (p->aShadow[i].iPg != -1) {
+	if (p->aShadow[i].iPg == iPg)
+	    return &p->aShadow[i];
+	i = (i + 1) & (p->nShadowSlot - 1);
+    }
+
+    return NULL;
+}
+
+/*
+** Add a saved page to the shadow table, growing it to keep it at most
+** half full.
+*/
+static int auroraShadowInsert(AuroraFile *p, sqlite3_int64 iPg, unsigned char *aPage){
+    AuroraShadow *aOld = p->aShadow;
+    int nOld = p->nShadowSlot;
+    unsigned int i;
+    int j;
+
+    if (2 * (p->nShadow + 1) > p->nShadowSlot) {
+	p->nShadowSlot = nOld > 0 ? 2 * nOld : 64;
+	p->aShadow = sqlite3_malloc64(p->nShadowSlot * sizeof(AuroraShadow));
+	if (p->aShadow == NULL) {
+	    p->aShadow = aOld;
+	    p->nShadowSlot = nOld;
+	    return SQLITE_NOMEM;
+	}
+
+	for (j = 0; j < p->nShadowSlot; j++)
+	    p->aShadow[j].iPg = -1;
+
+	p->nShadow = 0;
+	for (j = 0; j < nOld; j++) {
+	    if (aOld[j].iPg != -1)
+		auroraShadowInsert(p, aOld[j].iPg, aOld[j].aPage);
+	}
+	sqlite3_free(aOld);
+    }
+
+    i = (unsigned int)(iPg * 0x9E3779B1u) & (p->nShadowSlot - 1);
+    while (p->aShadow[i].iPg != -1)
+	i = (i + 1) & (p->nShadowSlot - 1);
+
+    p->aShadow[i].iPg = iPg;
+    p->aShadow[i].aPage = aPage;
+    p->nShadow += 1;
+
+    return SQLITE_OK;
+}
+
+static void auroraShadowFree(AuroraFile *p){
+    int i;
+
+    for (i = 0; i < p->nShadowSlot; i++) {
+	if (p->aShadow[i].iPg != -1)
+	    sqlite3_free(p->aShadow[i].aPage);
+    }
+
+    sqlite3_free(p->aShadow);
+    p->aShadow = NULL;
+    p->nShadowSlot = 0;
+    p->nShadow = 0;
+}
+
+/*
+** Called with ckptMutex held before bytes [iOfst, iOfst + nByte) of an
+** aurora-file are modified. Saves the current contents of every page in
+** the range that the running checkpoint has yet to persist.
+*/
+static int auroraCowPreserve(AuroraFile *p, sqlite3_int64 iOfst, sqlite3_int64 nByte){
+    sqlite3_int64 iPg, iLast, iPgOfst;
+    unsigned char *aPage;
+    int rc;
+
+    if (!p->bFrozen || nByte <= 0)
+	return SQLITE_OK;
+
+    iLast = (iOfst + nByte - 1) >> p->nDirtyShift;
+    for (iPg = iOfst >> p->nDirtyShift; iPg <= iLast; iPg++) {
+	if (!auroraDirtyTest(p->pCkptDirty, iPg) || auroraShadowFind(p, iPg) != NULL)
+	    continue;
+
+	aPage = sqlite3_malloc(p->szDirtyPg);
+	if (aPage == NULL)
+	    return SQLITE_NOMEM;
+
+	iPgOfst = iPg << p->nDirtyShift;
+	memcpy(aPage, p->aData + iPgOfst,
+		p->szMax - iPgOfst < p->szDirtyPg ? p->szMax - iPgOfst : p->szDirtyPg);
+
+	rc = auroraShadowInsert(p, iPg, aPage);
+	if (rc != SQLITE_OK) {
+	    sqlite3_free(aPage);
+	    return rc;
+	}
+    }
+
+    return SQLITE_OK;
+}
+
+/*
+** Return the contents of page iPg of the frozen dirty set as of the
+** freeze. Without copy-on-write this is just the live page, which the
+** caller must not read concurrently with writers.
+*/
+static const unsigned char *auroraCkptPage(AuroraFile *p, sqlite3_int64 iPg){
+    const unsigned char *aPage = p->aData + (iPg << p->nDirtyShift);
+    AuroraShadow *pShadow;
+
+    if (!p->bFrozen)
+	return aPage;
+
+    pthread_mutex_lock(&p->ckptMutex);
+    pShadow = auroraShadowFind(p, iPg);
+    if (pShadow != NULL)
+	aPage = pShadow->aPage;
+    pthread_mutex_unlock(&p->ckptMutex);
+
+    return aPage;
+}
+
+/*
+** Tell the copy-on-write machinery that the checkpoint has persisted page
+** iPg, which it read from aPage as returned by auroraCkptPage(). Later
+** writes to the page no longer need to save it. Returns true if a writer
+** saved the page while it was being read from the live region, in which
+** case the read may be torn and the page has to be persisted again from
+** auroraCkptPage().
+*/
+static bool auroraCkptPageDone(AuroraFile *p, sqlite3_int64 iPg, const unsigned char *aPage){
+    AuroraShadow *pShadow;
+    bool bRetry = false;
+
+    if (!p->bFrozen)
+	return false;
+
+    pthread_mutex_lock(&p->ckptMutex);
+    pShadow = auroraShadowFind(p, iPg);
+    if (pShadow != NULL && pShadow->aPage != aPage) {
+	bRetry = true;
+    } else if (auroraDirtyTest(p->pCkptDirty, iPg)) {
+	auroraDirtyClear(p->pCkptDirty, iPg);
+	auroraDirtySet(p->pCkptDone, iPg);
+    }
+    pthread_mutex_unlock(&p->ckptMutex);
+
+    return bRetry;
+}
+
+/*
+** Like auroraCkptPageDone(), but only tell whether page iPg may have been
+** torn while it was read from aPage, without marking it as persisted.
+*/
+static bool auroraCkptPageTorn(AuroraFile *p, sqlite3_int64 iPg, const unsigned char *aPage){
+    AuroraShadow *pShadow;
+    bool bTorn;
+
+    if (!p->bFrozen)
+	return false;
+
+    /* The shadow may be freed as soon as we drop the lock. */
+    pthread_mutex_lock(&p->ckptMutex);
+    pShadow = auroraShadowFind(p, iPg);
+    bTorn = pShadow != NULL && pShadow->aPage != aPage;
+    pthread_mutex_unlock(&p->ckptMutex);
+
+    return bTorn;
+}
+
+/*
+** Hash nByte bytes at a, never returning 0, which marks unknown hashes.
+** Four independent lanes keep the multiplier busy.
+*/
+static sqlite3_uint64 auroraHash(const unsigned char *a, sqlite3_int64 nByte){
+    sqlite3_uint64 aLane[4] = {
+	0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL,
+	0x94d049bb133111ebULL, 0x2545f4914f6cdd1dULL,
+    };
+    sqlite3_uint64 aWord[4], h;
+    sqlite3_int64 i;
+    int j;
+
+    for (i = 0; i + 32 <= nByte; i += 32) {
+	memcpy(aWord, a + i, 32);
+	for (j = 0; j < 4; j++) {
+	    aLane[j] = (aLane[j] ^ aWord[j]) * 0xff51afd7ed558ccdULL;
+	    aLane[j] ^= aLane[j] >> 32;
+	}
+    }
+
+    h = nByte;
+    for (j = 0; j < 4; j++)
+	h = (h ^ aLane[j]) * 0xc4ceb9fe1a85ec53ULL;
+    for (; i < nByte; i++)
+	h = (h ^ a[i]) * 0x100000001b3ULL;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+
+    return h == 0 ? 1 : h;
+}
+
+/*
+** Drop the pages of the frozen dirty set that hash the same as when they
+** were last checkpointed, and remember the hashes of the others. Must
+** run before anything of the set is persisted.
+*/
+static void auroraHashFilter(AuroraFile *p){
+    AuroraDirtyMap *pMap = p->pCkptDirty;
+    const unsigned char *aPage;
+    sqlite3_int64 iWord, iPg, iOfst, nByte;
+    sqlite3_uint64 mask, h;
+    bool bSame;
+
+    if (p->aPageHash == NULL)
+	return;
+
+    for (iWord = pMap->iLo; iWord < pMap->iHi; iWord++) {
+	for (mask = pMap->aBit[iWord]; mask != 0; mask &= mask - 1) {
+	    iPg = iWord * 64 + __builtin_ctzll(mask);
+	    iOfst = iPg << p->nDirtyShift;
+	    nByte = p->szMax - iOfst < p->szDirtyPg ? p->szMax - iOfst : p->szDirtyPg;
+
+	    /* Retry torn reads, as the hash must match what gets persisted. */
+	    do {
+		aPage = auroraCkptPage(p, iPg);
+		h = auroraHash(aPage, nByte);
+		bSame = h == p->aPageHash[iPg];
+	    } while (bSame ? auroraCkptPageDone(p, iPg, aPage) :
+		    auroraCkptPageTorn(p, iPg, aPage));
+
+	    if (bSame && !p->bFrozen)
+		auroraDirtyClear(pMap, iPg);
+	    p->aPageHash[iPg] = h;
+	}
+    }
+}
+
+/*
+** Freeze the pages written so far as the set the next checkpoint has to
+** persist, and start tracking subsequent writes in a clean set. The
+** previously frozen set must have been released. In async mode the
+** caller must hold ckptMutex.
+*/
+static void auroraDirtyFreeze(AuroraFile *p){
+    AuroraDirtyMap *pMap;
+
+    p->szCkpt = p->sz;
+    if (p->szDirtyPg == 0)
+	return;
+
+    pMap = p->pCkptDirty;
+    p->pCkptDirty = p->pDirty;
+    p->pDirty = pMap;
+    p->bFrozen = p->bCow;
+}
+
+/*
+** Forget the frozen dirty set once the checkpoint has persisted it.
+*/
+static void auroraDirtyRelease(AuroraFile *p){
+    if (p->bFrozen) {
+	pthread_mutex_lock(&p->ckptMutex);
+	p->bFrozen = false;
+	auroraShadowFree(p);
+	pthread_mutex_unlock(&p->ckptMutex);
+    }
+
+    if (p->szDirtyPg == 0)
+	return;
+
+    auroraDirtyReset(p, p->pCkptDirty);
+    auroraDirtyReset(p, p->pCkptDone);
+}
+
+/*
+** The checkpoint of the frozen dirty set failed. Hand all of it to the
+** next one, including the pages that were already given to the backend,
+** as they may not have made it. Call before auroraDirtyRelease().
+*/
+static void auroraDirtyRetry(AuroraFile *p){
+    if (p->szDirtyPg == 0)
+	return;
+
+    auroraCkptLock(p);
+    auroraDirtyMerge(p, p->pCkptDirty);
+    auroraDirtyMerge(p, p->pCkptDone);
+    auroraCkptUnlock(p);
+}
+
+/*
+** Iterate over the frozen dirty set of an aurora-file as a list of
+** coalesced byte extents, clipped to the file size at freeze time. Start
+** with *piPg set to 0; each call stores the next extent in *piOfst and
+** *pnByte and returns 1, or returns 0 once the set is exhausted.
+*/
+static int auroraDirtyNext(
+        AuroraFile *p,
+        sqlite3_int64 *piPg,
+        sqlite3_int64 *piOfst,
+        sqlite3_int64 *pnByte
+){
+    AuroraDirtyMap *pMap = p->pCkptDirty;
+    sqlite3_int64 iPg = *piPg;
+    sqlite3_int64 iFirst, iWord, iEnd;
+    sqlite3_uint64 w;
+
+    if (p->szDirtyPg == 0)
+	return 0;
+
+    if (iPg < pMap->iLo * 64)
+	iPg = pMap->iLo * 64;
+
+    /* Find the first set bit at or after iPg. */
+    for (iWord = iPg / 64; iWord < pMap->iHi; iWord++) {
+	w = pMap->aBit[iWord];
+	if (iWord == iPg / 64)
+	    w &= ~0ULL << (iPg & 63);
+	if (w != 0)
+	    break;
+    }
+    if (iWord >= pMap->iHi)
+	return 0;
+    iFirst = iWord * 64 + __builtin_ctzll(w);
+
+    /* Extend the extent up to the next clear bit. */
+    for (iPg = iFirst + 1; iPg < pMap->iHi * 64; iPg++) {
+	if ((pMap->aBit[iPg / 64] & (1ULL << (iPg & 63))) == 0)
+	    break;
+    }
+
+    *piPg = iPg;
+    *piOfst = iFirst << p->nDirtyShift;
+    iEnd = iPg << p->nDirtyShift;
+    if (iEnd > p->szCkpt)
+	iEnd = p->szCkpt;
+    if (iEnd <= *piOfst)
+	return 0;
+    *pnByte = iEnd - *piOfst;
+
+    return 1;
+}
+
+static void auroraBucketInit(AuroraBucket *pBucket, sqlite3_int64 nRate){
+    pthread_mutex_init(&pBucket->mutex, NULL);
+    pBucket->nRate = nRate;
+    pBucket->nBurst = nRate;
+    pBucket->nToken = nRate;
+    pBucket->iLastUs = auroraNowUs();
+}
+
+/*
+** Take nByte tokens from the bucket, first sleeping until the bucket is
+** out of debt. Taking more than is available is allowed, so arbitrarily
+** large writes go through, and later takers pay for them.
+*/
+static void auroraBucketTake(AuroraBucket *pBucket, sqlite3_int64 nByte){
+    sqlite3_int64 iNow, nWaitUs;
+
+    if (pBucket->nRate == 0 || nByte <= 0)
+	return;
+
+    pthread_mutex_lock(&pBucket->mutex);
+    for (;;) {
+	iNow = auroraNowUs();
+	if (iNow - pBucket->iLastUs > 1000000)
+	    pBucket->nToken = pBucket->nBurst;
+	else
+	    pBucket->nToken += (iNow - pBucket->iLastUs) * pBucket->nRate / 1000000;
+	if (pBucket->nToken > pBucket->nBurst)
+	    pBucket->nToken = pBucket->nBurst;
+	pBucket->iLastUs = iNow;
+
+	if (pBucket->nToken >= 0)
+	    break;
+
+	nWaitUs = -pBucket->nToken * 1000000 / pBucket->nRate + 1;
+	pthread_mutex_unlock(&pBucket->mutex);
+	usleep(nWaitUs);
+	pthread_mutex_lock(&pBucket->mutex);
+    }
+    pBucket->nToken -= nByte;
+    pthread_mutex_unlock(&pBucket->mutex);
+}
+
+/*
+** Slow down a writer that is szUndurable bytes ahead of durability. Past
+** the high-water mark the delay grows linearly with the overshoot, up to
+** AURORA_THROTTLE_MAX_US at twice the mark; small delays just yield.
+*/
+static void auroraThrottle(AuroraFile *p, sqlite3_int64 szUndurable){
+    sqlite3_int64 nOver, nDelayUs;
+
+    if (p->szHighWater == 0 || szUndurable <= p->szHighWater)
+	return;
+
+    nOver = szUndurable - p->szHighWater;
+    if (nOver >= p->szHighWater)
+	nDelayUs = AURORA_THROTTLE_MAX_US;
+    else
+	nDelayUs = AURORA_THROTTLE_MAX_US * nOver / p->szHighWater;
+
+    if (nDelayUs < AURORA_THROTTLE_MIN_US)
+	sched_yield();
+    else
+	usleep(nDelayUs);
+}
+
+static int auroraPutVarint(unsigned char *a, sqlite3_uint64 v){
+    int n = 0;
+
+    while (v >= 0x80) {
+	a[n++] = (unsigned char)(v | 0x80);
+	v >>= 7;
+    }
+    a[n++] = (unsigned char)v;
+
+    return n;
+}
+
+static int auroraGetVarint(const unsigned char *a, int nAvail, sqlite3_uint64 *pV){
+    sqlite3_uint64 v = 0;
+    int n;
+
+    for (n = 0; n < nAvail && n < 10; n++) {
+	v |= (sqlite3_uint64)(a[n] & 0x7f) << (7 * n);
+	if ((a[n] & 0x80) == 0) {
+	    *pV = v;
+	    return n + 1;
+	}
+    }
+
+    return 0;
+}
+
+/*
+** Encode the XOR of aNew and aOld, nByte bytes each, into aOut, which has
+** room for nByte bytes. Returns the size of the delta, or -1 if it would
+** not be smaller than the page itself.
+*/
+static int auroraDeltaEncode(
+        const unsigned char *aNew,
+        const unsigned char *aOld,
+        int nByte,
+        unsigned char *aOut
+){
+    sqlite3_uint64 wNew, wOld;
+    int i = 0, iLit, nOut = 0;
+    int nZero, nLit, j;
+
+    while (i < nByte) {
+	/* Skip identical bytes, a word at a time where possible. */
+	iLit = i;
+	while (iLit + 8 <= nByte) {
+	    memcpy(&wNew, aNew + iLit, 8);
+	    memcpy(&wOld, aOld + iLit, 8);
+	    if (wNew != wOld)
+		break;
+	    iLit += 8;
+	}
+	while (iLit < nByte && aNew[iLit] == aOld[iLit])
+	    iLit++;
+	if (iLit == nByte)
+	    break;
+	nZero = iLit - i;
+
+	/* Literals end at the next run of 8 identical bytes. */
+	for (i = iLit, j = 0; i < nByte && j < 8; i++)
+	    j = aNew[i] == aOld[i] ? j + 1 : 0;
+	nLit = i - iLit - j;
+
+	if (nOut + 20 + nLit >= nByte)
+	    return -1;
+	nOut += auroraPutVarint(aOut + nOut, nZero);
+	nOut += auroraPutVarint(aOut + nOut, nLit);
+	for (j = 0; j < nLit; j++)
+	    aOut[nOut + j] = aNew[iLit + j] ^ aOld[iLit + j];
+	nOut += nLit;
+	i = iLit + nLit;
+    }
+
+    return nOut;
+}
+
+/*
+** Apply a delta produced by auroraDeltaEncode() to the nByte bytes of
+** aPage, which hold the previous image of the page.
+*/
+static int auroraDeltaApply(unsigned char *aPage, int nByte, const unsigned char *aDelta, int nDelta){
+    sqlite3_uint64 nZero, nLit;
+    sqlite3_int64 iOfst = 0;
+    int i = 0, n, j;
+
+    while (i < nDelta) {
+	n = auroraGetVarint(aDelta + i, nDelta - i, &nZero);
+	if (n == 0)
+	    return SQLITE_CORRUPT;
+	i += n;
+	n = auroraGetVarint(aDelta + i, nDelta - i, &nLit);
+	if (n == 0)
+	    return SQLITE_CORRUPT;
+	i += n;
+
+	if (nZero > nByte - iOfst || nLit > nByte - iOfst - nZero || nLit > nDelta - i)
+	    return SQLITE_CORRUPT;
+	iOfst += nZero;
+	for (j = 0; j < nLit; j++)
+	    aPage[iOfst + j] ^= aDelta[i + j];
+	iOfst += nLit;
+	i += nLit;
+    }
+
+    return SQLITE_OK;
+}
+
+/*
+** Rebuild a page from a record, given aPage holding its previous image.
+** aTmp must have room for pRec->nDelta bytes.
+*/
+static int auroraPageRecApply(
+        const AuroraPageRec *pRec,
+        const unsigned char *aPayload,
+        unsigned char *aPage,
+        unsigned char *aTmp
+){
+    const unsigned char *aData = aPayload;
+    int nData = pRec->nPayload;
+
+    if (pRec->eEnc & AURORA_ENC_ZSTD) {
+#ifdef AURORA_HAVE_ZSTD
+	size_t n = ZSTD_decompress(aTmp, pRec->nDelta, aPayload, pRec->nPayload);
+	if (ZSTD_isError(n) || n != (size_t)pRec->nDelta)
+	    return SQLITE_CORRUPT;
+	aData = aTmp;
+	nData = n;
+#else
+	return SQLITE_CORRUPT;
+#endif
+    }
+
+    if ((pRec->eEnc & ~AURORA_ENC_ZSTD) == AURORA_ENC_DELTA)
+	return auroraDeltaApply(aPage, pRec->nByte, aData, nData);
+
+    if (nData != pRec->nByte)
+	return SQLITE_CORRUPT;
+    memcpy(aPage, aData, nData);
+
+    return SQLITE_OK;
+}
+
+/*
+** Hand the frozen image of page iPg to the xAppend method of the backend,
+** encoded as configured. aCur and aEnc are scratch space of a page each,
+** aZip of ZSTD_compressBound() of a page when compressing.
+*/
+static int auroraFlushRec(
+        AuroraFile *p,
+        sqlite3_int64 iPg,
+        unsigned char *aCur,
+        unsigned char *aEnc,
+        unsigned char *aZip
+){
+    unsigned char **ppBase = p->apBase != NULL ? &p->apBase[iPg] : NULL;
+    const unsigned char *aPage, *aPayload;
+    AuroraPageRec rec;
+    int nDelta, rc;
+
+    rec.iOfst = iPg << p->nDirtyShift;
+    rec.nByte = p->szDirtyPg;
+    if (rec.iOfst + rec.nByte > p->szMax)
+	rec.nByte = p->szMax - rec.iOfst;
+
+    do {
+	auroraBucketTake(&p->bucket, rec.nByte);
+
+	/* Work on a stable copy, the base has to match what was logged. */
+	aPage = auroraCkptPage(p, iPg);
+	memcpy(aCur, aPage, rec.nByte);
+
+	rec.eEnc = AURORA_ENC_RAW;
+	aPayload = aCur;
+	rec.nDelta = rec.nByte;
+	if (ppBase != NULL && *ppBase != NULL) {
+	    nDelta = auroraDeltaEncode(aCur, *ppBase, rec.nByte, aEnc);
+	    if (nDelta >= 0) {
+		rec.eEnc = AURORA_ENC_DELTA;
+		aPayload = aEnc;
+		rec.nDelta = nDelta;
+	    }
+	}
+	rec.nPayload = rec.nDelta;
+
+#ifdef AURORA_HAVE_ZSTD
+	if (p->bCompress) {
+	    size_t n = ZSTD_compress(aZip, ZSTD_compressBound(p->szDirtyPg),
+		    aPayload, rec.nDelta, AURORA_ZSTD_LEVEL);
+	    if (!ZSTD_isError(n) && n < (size_t)rec.nDelta) {
+		rec.eEnc |= AURORA_ENC_ZSTD;
+		aPayload = aZip;
+		rec.nPayload = n;
+	    }
+	}
+#endif
+
+	rc = p->pBackend->xAppend(p, &rec, aPayload);
+	if (rc != SQLITE_OK)
+	    return rc;
+
+	if (ppBase != NULL) {
+	    if (*ppBase == NULL)
+		*ppBase = sqlite3_malloc(p->szDirtyPg);
+	    if (*ppBase != NULL)
+		memcpy(*ppBase, aCur, rec.nByte);
+	}
+    } while (auroraCkptPageDone(p, iPg, aPage));
+
+    return SQLITE_OK;
+}
+
+/* Forget all base images, so the next records are not deltas. */
+static void auroraBaseReset(AuroraFile *p){
+    sqlite3_int64 iPg;
+
+    if (p->apBase == NULL)
+	return;
+
+    for (iPg = 0; iPg < p->nDirtyWord * 64; iPg++) {
+	sqlite3_free(p->apBase[iPg]);
+	p->apBase[iPg] = NULL;
+    }
+}
+
+/*
+** Log the dirty pages in bitmap words [iLo, iHi) of the frozen dirty set
+** as records.
+*/
+static int auroraFlushRecs(AuroraFile *p, sqlite3_int64 iLo, sqlite3_int64 iHi){
+    unsigned char *aCur, *aEnc, *aZip = NULL;
+    sqlite3_int64 iPg;
+    int rc = SQLITE_OK;
+
+    aCur = sqlite3_malloc(p->szDirtyPg);
+    aEnc = sqlite3_malloc(p->szDirtyPg);
+#ifdef AURORA_HAVE_ZSTD
+    if (p->bCompress)
+	aZip = sqlite3_malloc(ZSTD_compressBound(p->szDirtyPg));
+    if (p->bCompress && aZip == NULL)
+	rc = SQLITE_NOMEM;
+#endif
+    if (aCur == NULL || aEnc == NULL)
+	rc = SQLITE_NOMEM;
+
+    for (iPg = iLo * 64; iPg < iHi * 64 && rc == SQLITE_OK; iPg++) {
+	if (!auroraDirtyTest(p->pCkptDirty, iPg))
+	    continue;
+	if ((iPg << p->nDirtyShift) >= p->szCkpt)
+	    break;
+
+	rc = auroraFlushRec(p, iPg, aCur, aEnc, aZip);
+    }
+
+    sqlite3_free(aZip);
+    sqlite3_free(aEnc);
+    sqlite3_free(aCur);
+
+    return rc;
+}
+
+/*
+** Flush the pages of the frozen dirty set in bitmap words [iLo, iHi)
+** through the xWrite method of the backend. With copy-on-write every page
+** is written from its checkpoint-time image; otherwise runs of dirty
+** pages are written straight from the region. Without dirty tracking
+** the words stand for the whole region, 64 chunks of szFlushChunk each.
+*/
+static int auroraFlushRange(AuroraFile *p, sqlite3_int64 iLo, sqlite3_int64 iHi){
+    const AuroraBackend *pBackend = p->pBackend;
+    sqlite3_int64 iPg, iEnd, iOfst, nByte;
+    const unsigned char *aPage;
+    int nShift = p->nDirtyShift;
+    int rc;
+
+    if (pBackend->xAppend != NULL)
+	return auroraFlushRecs(p, iLo, iHi);
+
+    if (p->szDirtyPg == 0) {
+	iOfst = iLo * 64 * AURORA_FLUSH_CHUNK;
+	iEnd = iHi * 64 * AURORA_FLUSH_CHUNK;
+	if (iEnd > p->szCkpt)
+	    iEnd = p->szCkpt;
+	if (iEnd <= iOfst)
+	    return SQLITE_OK;
+	auroraBucketTake(&p->bucket, iEnd - iOfst);
+	return pBackend->xWrite(p, iOfst, p->aData + iOfst, iEnd - iOfst);
+    }
+
+    for (iPg = iLo * 64; iPg < iHi * 64; iPg++) {
+	if (!auroraDirtyTest(p->pCkptDirty, iPg))
+	    continue;
+
+	iOfst = iPg << nShift;
+	if (iOfst >= p->szCkpt)
+	    break;
+
+	if (!p->bFrozen) {
+	    for (iEnd = iPg + 1; iEnd < iHi * 64; iEnd++) {
+		if (!auroraDirtyTest(p->pCkptDirty, iEnd))
+		    break;
+	    }
+
+	    nByte = (iEnd << nShift) - iOfst;
+	    if (iOfst + nByte > p->szCkpt)
+		nByte = p->szCkpt - iOfst;
+	    auroraBucketTake(&p->bucket, nByte);
+	    rc = pBackend->xWrite(p, iOfst, p->aData + iOfst, nByte);
+	    if (rc != SQLITE_OK)
+		return rc;
+
+	    iPg = iEnd;
+	    continue;
+	}
+
+	nByte = p->szDirtyPg;
+	if (iOfst + nByte > p->szCkpt)
+	    nByte = p->szCkpt - iOfst;
+	do {
+	    auroraBucketTake(&p->bucket, nByte);
+	    aPage = auroraCkptPage(p, iPg);
+	    rc = pBackend->xWrite(p, iOfst, aPage, nByte);
+	    if (rc != SQLITE_OK)
+		return rc;
+	} while (auroraCkptPageDone(p, iPg, aPage));
+    }
+
+    return SQLITE_OK;
+}
+
+static void auroraFlushJobDone(AuroraFlushJob *pJob, int rc){
+    AuroraFlushBarrier *pBarrier = pJob->pBarrier;
+
+    pthread_mutex_lock(&pBarrier->mutex);
+    if (rc != SQLITE_OK && pBarrier->rc == SQLITE_OK)
+	pBarrier->rc = rc;
+    pBarrier->nPending -= 1;
+    if (pBarrier->nPending == 0)
+	pthread_cond_signal(&pBarrier->cond);
+    pthread_mutex_unlock(&pBarrier->mutex);
+}
+
+static void *auroraFlushWorker(void *pArg){
+    AuroraFlushPool *pPool = (AuroraFlushPool *)pArg;
+    AuroraFlushJob *pJob;
+
+    pthread_mutex_lock(&pPool->mutex);
+    for (;;) {
+	while (pPool->pJobs == NULL && !pPool->bExit)
+	    pthread_cond_wait(&pPool->cond, &pPool->mutex);
+
+	if (pPool->pJobs == NULL)
+	    break;
+
+	pJob = pPool->pJobs;
+	pPool->pJobs = pJob->pNext;
+	pthread_mutex_unlock(&pPool->mutex);
+
+	auroraFlushJobDone(pJob, auroraFlushRange(pJob->p, pJob->iLo, pJob->iHi));
+
+	pthread_mutex_lock(&pPool->mutex);
+    }
+    pthread_mutex_unlock(&pPool->mutex);
+
+    return NULL;
+}
+
+/*
+** Take a reference to the flush pool, growing it to nThread threads if
+** it can. The thread that checkpoints also flushes, so the pool itself
+** only needs nThread - 1 of them. Having fewer just flushes slower, see
+** auroraFlushTake().
+*/
+static int auroraFlushPoolAcquire(int nThread){
+    AuroraFlushPool *pPool = &auroraFlushPool;
+    pthread_t *aThread;
+    int rc = SQLITE_OK;
+
+    pthread_mutex_lock(&pPool->mutex);
+    pPool->nRef += 1;
+    if (nThread - 1 > pPool->nThread) {
+	aThread = sqlite3_realloc64(pPool->aThread, (nThread - 1) * sizeof(pthread_t));
+	if (aThread == NULL) {
+	    rc = SQLITE_NOMEM;
+	} else {
+	    pPool->aThread = aThread;
+	    while (pPool->nThread < nThread - 1) {
+		if (pthread_create(&aThread[pPool->nThread], NULL,
+			    auroraFlushWorker, pPool) != 0)
+		    break;
+		pPool->nThread += 1;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&pPool->mutex);
+
+    return rc;
+}
+
+static void auroraFlushPoolRelease(void){
+    AuroraFlushPool *pPool = &auroraFlushPool;
+    pthread_t *aThread;
+    int i, nThread;
+
+    pthread_mutex_lock(&pPool->mutex);
+    pPool->nRef -= 1;
+    if (pPool->nRef > 0 || pPool->nThread == 0) {
+	pthread_mutex_unlock(&pPool->mutex);
+	return;
+    }
+
+    aThread = pPool->aThread;
+    nThread = pPool->nThread;
+    pPool->aThread = NULL;
+    pPool->nThread = 0;
+    pPool->bExit = true;
+    pthread_cond_broadcast(&pPool->cond);
+    pthread_mutex_unlock(&pPool->mutex);
+
+    for (i = 0; i < nThread; i++)
+	pthread_join(aThread[i], NULL);
+    sqlite3_free(aThread);
+
+    pthread_mutex_lock(&pPool->mutex);
+    pPool->bExit = false;
+    pthread_mutex_unlock(&pPool->mutex);
+}
+
+/*
+** Unqueue a job of pBarrier that no worker has picked up yet, or return
+** NULL if there are none.
+*/
+static AuroraFlushJob *auroraFlushTake(AuroraFlushBarrier *pBarrier){
+    AuroraFlushPool *pPool = &auroraFlushPool;
+    AuroraFlushJob **ppJob, *pJob;
+
+    pthread_mutex_lock(&pPool->mutex);
+    for (ppJob = &pPool->pJobs; *ppJob != NULL; ppJob = &(*ppJob)->pNext) {
+	if ((*ppJob)->pBarrier == pBarrier)
+	    break;
+    }
+    pJob = *ppJob;
+    if (pJob != NULL)
+	*ppJob = pJob->pNext;
+    pthread_mutex_unlock(&pPool->mutex);
+
+    return pJob;
+}
+
+/*
+** Write the frozen dirty set of an aurora-file out through the backend,
+** split into up to nFlushThread partitions with about the same number of
+** dirty pages each. The calling thread flushes the first partition, and
+** then any the pool is too busy or too small to get to, and returns once
+** all of them are done.
+*/
+static int auroraFlush(AuroraFile *p){
+    AuroraFlushJob aJob[AURORA_MAX_FLUSH_THREADS], *pJob;
+    AuroraDirtyMap *pMap = p->pCkptDirty;
+    AuroraFlushBarrier barrier;
+    sqlite3_int64 iLo, iHi, iWord, nPage, nSeen;
+    int nJob, i, rc;
+
+    if (p->szDirtyPg == 0) {
+	iLo = 0;
+	iHi = (p->szCkpt + 64 * AURORA_FLUSH_CHUNK - 1) / (64 * AURORA_FLUSH_CHUNK);
+	nPage = iHi;
+    } else {
+	iLo = pMap->iLo;
+	iHi = pMap->iHi;
+	nPage = pMap->nPage;
+    }
+
+    if (iLo >= iHi)
+	return SQLITE_OK;
+
+    if (p->nFlushThread <= 1)
+	return auroraFlushRange(p, iLo, iHi);
+
+    /* Cut the words into partitions of about nPage / nFlushThread pages. */
+    nJob = 0;
+    nSeen = 0;
+    aJob[0].iLo = iLo;
+    for (iWord = iLo; iWord < iHi && nJob < p->nFlushThread - 1; iWord++) {
+	nSeen += p->szDirtyPg == 0 ? 1 : __builtin_popcountll(pMap->aBit[iWord]);
+	if (nSeen * p->nFlushThread >= (nJob + 1) * nPage) {
+	    aJob[nJob].iHi = iWord + 1;
+	    nJob += 1;
+	    aJob[nJob].iLo = iWord + 1;
+	}
+    }
+    aJob[nJob].iHi = iHi;
+    if (aJob[nJob].iLo < iHi)
+	nJob += 1;
+
+    pthread_mutex_init(&barrier.mutex, NULL);
+    pthread_cond_init(&barrier.cond, NULL);
+    barrier.nPending = nJob;
+    barrier.rc = SQLITE_OK;
+
+    pthread_mutex_lock(&auroraFlushPool.mutex);
+    for (i = nJob - 1; i >= 1; i--) {
+	aJob[i].p = p;
+	aJob[i].pBarrier = &barrier;
+	aJob[i].pNext = auroraFlushPool.pJobs;
+	auroraFlushPool.pJobs = &aJob[i];
+    }
+    pthread_cond_broadcast(&auroraFlushPool.cond);
+    pthread_mutex_unlock(&auroraFlushPool.mutex);
+
+    aJob[0].pBarrier = &barrier;
+    auroraFlushJobDone(&aJob[0], auroraFlushRange(p, aJob[0].iLo, aJob[0].iHi));
+    while ((pJob = auroraFlushTake(&barrier)) != NULL)
+	auroraFlushJobDone(pJob, auroraFlushRange(p, pJob->iLo, pJob->iHi));
+
+    pthread_mutex_lock(&barrier.mutex);
+    while (barrier.nPending > 0)
+	pthread_cond_wait(&barrier.cond, &barrier.mutex);
+    rc = barrier.rc;
+    pthread_mutex_unlock(&barrier.mutex);
+
+    pthread_cond_destroy(&barrier.cond);
+    pthread_mutex_destroy(&barrier.mutex);
+
+    return rc;
+}
+
+/*
+** Find or create the scheduler tenant called zName. Returns NULL on OOM.
+** New tenants start at the virtual time of the last grant, so they cannot
+** claim turns for the time they were not around.
+*/
+static AuroraTenant *auroraTenantAcquire(const char *zName){
+    AuroraSched *pSched = &auroraSched;
+    AuroraTenant *pTenant;
+
+    pthread_mutex_lock(&pSched->mutex);
+    for (pTenant = pSched->pTenants; pTenant != NULL; pTenant = pTenant->pNext) {
+	if (strcmp(pTenant->zName, zName) == 0)
+	    break;
+    }
+
+    if (pTenant == NULL) {
+	pTenant = sqlite3_malloc(sizeof(*pTenant) + strlen(zName) + 1);
+	if (pTenant == NULL) {
+	    pthread_mutex_unlock(&pSched->mutex);
+	    return NULL;
+	}
+
+	pTenant->zName = (char *)&pTenant[1];
+	strcpy(pTenant->zName, zName);
+	pTenant->nRef = 0;
+	pTenant->nVirtual = pSched->nVirtual;
+	pTenant->pNext = pSched->pTenants;
+	pSched->pTenants = pTenant;
+    }
+    pTenant->nRef += 1;
+    pthread_mutex_unlock(&pSched->mutex);
+
+    return pTenant;
+}
+
+static void auroraTenantRelease(AuroraTenant *pTenant){
+    AuroraSched *pSched = &auroraSched;
+    AuroraTenant **ppTenant;
+
+    pthread_mutex_lock(&pSched->mutex);
+    pTenant->nRef -= 1;
+    if (pTenant->nRef == 0) {
+	for (ppTenant = &pSched->pTenants; *ppTenant != pTenant;
+		ppTenant = &(*ppTenant)->pNext)
+	    ;
+	*ppTenant = pTenant->pNext;
+	sqlite3_free(pTenant);
+    }
+    pthread_mutex_unlock(&pSched->mutex);
+}
+
+/*
+** Pick the queued checkpoint to run next: one of the tenant furthest
+** behind, and of those the one with the most bytes, counting a
+** microsecond of waiting as a byte, times its priority. The caller holds
+** the scheduler mutex.
+*/
+static AuroraSchedWaiter **auroraSchedPick(sqlite3_int64 iNow){
+    AuroraSchedWaiter **ppWaiter, **ppBest = NULL;
+    sqlite3_int64 nScore, nBest = 0;
+    AuroraTenant *pTenant, *pBest = NULL;
+
+    for (ppWaiter = &auroraSched.pQueue; *ppWaiter != NULL;
+	    ppWaiter = &(*ppWaiter)->pNext) {
+	pTenant = (*ppWaiter)->p->pTenant;
+	nScore = ((*ppWaiter)->nByte + iNow - (*ppWaiter)->iQueuedUs) *
+	    (*ppWaiter)->p->nCkptPriority;
+
+	if (ppBest == NULL || pTenant->nVirtual < pBest->nVirtual ||
+		(pTenant == pBest && nScore > nBest)) {
+	    ppBest = ppWaiter;
+	    pBest = pTenant;
+	    nBest = nScore;
+	}
+    }
+
+    return ppBest;
+}
+
+/* Run queued checkpoints while there are free slots. Needs the mutex. */
+static void auroraSchedGrant(void){
+    AuroraSched *pSched = &auroraSched;
+    sqlite3_int64 iNow = auroraNowUs();
+    AuroraSchedWaiter **ppWaiter, *pWaiter;
+    AuroraTenant *pTenant;
+    sqlite3_int64 nWaitUs;
+    bool bGranted = false;
+
+    while (pSched->pQueue != NULL &&
+	    (pSched->nSlot == 0 || pSched->nRunning < pSched->nSlot)) {
+	ppWaiter = auroraSchedPick(iNow);
+	pWaiter = *ppWaiter;
+	*ppWaiter = pWaiter->pNext;
+
+	pTenant = pWaiter->p->pTenant;
+	pSched->nVirtual = pTenant->nVirtual;
+	pTenant->nVirtual += (pWaiter->nByte + 1) / pWaiter->p->nCkptPriority;
+
+	nWaitUs = iNow - pWaiter->iQueuedUs;
+	pWaiter->p->nSchedWaitUs = nWaitUs;
+	pSched->nWaitUs += nWaitUs;
+	if (nWaitUs > pSched->nMaxWaitUs)
+	    pSched->nMaxWaitUs = nWaitUs;
+
+	pSched->nGranted += 1;
+	pSched->nQueued -= 1;
+	pSched->nRunning += 1;
+	pWaiter->bGranted = true;
+	bGranted = true;
+    }
+
+    if (bGranted)
+	pthread_cond_broadcast(&pSched->cond);
+}
+
+/*
+** Wait for the scheduler to let a checkpoint of nByte bytes of an
+** aurora-file run. Must be paired with auroraSchedLeave().
+*/
+static void auroraSchedEnter(AuroraFile *p, sqlite3_int64 nByte){
+    AuroraSched *pSched = &auroraSched;
+    AuroraSchedWaiter waiter;
+
+    waiter.p = p;
+    waiter.nByte = nByte;
+    waiter.iQueuedUs = auroraNowUs();
+    waiter.bGranted = false;
+
+    pthread_mutex_lock(&pSched->mutex);
+
+    /* Tenants do not save up turns while they have nothing to do. */
+    if (p->pTenant->nVirtual < pSched->nVirtual)
+	p->pTenant->nVirtual = pSched->nVirtual;
+
+    waiter.pNext = pSched->pQueue;
+    pSched->pQueue = &waiter;
+    pSched->nQueued += 1;
+    auroraSchedGrant();
+
+    while (!waiter.bGranted)
+	pthread_cond_wait(&pSched->cond, &pSched->mutex);
+    pthread_mutex_unlock(&pSched->mutex);
+}
+
+static void auroraSchedLeave(void){
+    AuroraSched *pSched = &auroraSched;
+
+    pthread_mutex_lock(&pSched->mutex);
+    pSched->nRunning -= 1;
+    auroraSchedGrant();
+    pthread_mutex_unlock(&pSched->mutex);
+}
+
+/*
+** Cap the number of concurrent checkpoints at nSlot. Files cannot raise
+** the cap another one asked for, so the smallest one applies.
+*/
+static void auroraSchedSetSlots(int nSlot){
+    AuroraSched *pSched = &auroraSched;
+
+    pthread_mutex_lock(&pSched->mutex);
+    if (pSched->nSlot == 0 || nSlot < pSched->nSlot)
+	pSched->nSlot = nSlot;
+    pthread_mutex_unlock(&pSched->mutex);
+}
+
+/*
+** Find or create the group commit state for fd. Returns NULL on OOM.
+*/
+static AuroraGroupCommit *auroraGroupAcquire(int fd){
+    AuroraGroupCommit *pGroup;
+
+    pthread_mutex_lock(&auroraGroupMutex);
+    for (pGroup = auroraGroupList; pGroup != NULL; pGroup = pGroup->pNext) {
+	if (pGroup->fd == fd)
+	    break;
+    }
+
+    if (pGroup == NULL) {
+	pGroup = sqlite3_malloc(sizeof(*pGroup));
+	if (pGroup == NULL) {
+	    pthread_mutex_unlock(&auroraGroupMutex);
+	    return NULL;
+	}
+
+	memset(pGroup, 0, sizeof(*pGroup));
+	pGroup->fd = fd;
+	/* Batches count from 1, as iBatchDone is 0 before the first one. */
+	pGroup->iBatch = 1;
+	pthread_mutex_init(&pGroup->mutex, NULL);
+	pthread_cond_init(&pGroup->cond, NULL);
+	pGroup->pNext = auroraGroupList;
+	auroraGroupList = pGroup;
+    }
+
+    pGroup->nRef += 1;
+    pthread_mutex_unlock(&auroraGroupMutex);
+
+    return pGroup;
+}
+
+/*
+** Drop a reference to a group commit state, freeing it with the last one.
+*/
+static void auroraGroupRelease(AuroraGroupCommit *pGroup){
+    AuroraGroupCommit **ppGroup;
+
+    pthread_mutex_lock(&auroraGroupMutex);
+    pGroup->nRef -= 1;
+    if (pGroup->nRef > 0) {
+	pthread_mutex_unlock(&auroraGroupMutex);
+	return;
+    }
+
+    for (ppGroup = &auroraGroupList; *ppGroup != pGroup; ppGroup = &(*ppGroup)->pNext)
+	;
+    *ppGroup = pGroup->pNext;
+    pthread_mutex_unlock(&auroraGroupMutex);
+
+    pthread_cond_destroy(&pGroup->cond);
+    pthread_mutex_destroy(&pGroup->mutex);
+    sqlite3_free(pGroup);
+}
+
+#ifdef AURORA_HAVE_SLS
+/*
+** Take a snapshot as part of a group commit. The caller returns only after
+** a snapshot that started after it joined the batch has completed, so the
+** durability guarantee is the same as calling sas_trace_commit() directly.
+** The result is that of the snapshot of its batch, or of a later one if
+** that finished before the caller got to look, which covers it as well.
+*/
+static int auroraGroupCommit(AuroraGroupCommit *pGroup, sqlite3_uint64 nWindowUs){
+    sqlite3_uint64 iBatch;
+    int rc;
+
+    pthread_mutex_lock(&pGroup->mutex);
+    iBatch = pGroup->iBatch;
+
+    if (pGroup->bOpen) {
+	/* Somebody else is leading this batch, wait for it to be done. */
+	while (pGroup->iBatchDone < iBatch)
+	    pthread_cond_wait(&pGroup->cond, &pGroup->mutex);
+
+	rc = pGroup->rcBatch;
+	pthread_mutex_unlock(&pGroup->mutex);
+	return rc;
+    }
+
+    /* We are the leader, let the batch fill up. */
+    pGroup->bOpen = true;
+    pthread_mutex_unlock(&pGroup->mutex);
+
+    usleep(nWindowUs);
+
+    pthread_mutex_lock(&pGroup->mutex);
+    pGroup->bOpen = false;
+    pGroup->iBatch += 1;
+
+    /* The previous batch may still be snapshotting. */
+    while (pGroup->bCommitting)
+	pthread_cond_wait(&pGroup->cond, &pGroup->mutex);
+    pGroup->bCommitting = true;
+    pthread_mutex_unlock(&pGroup->mutex);
+
+    rc = sas_trace_commit(pGroup->fd);
+
+    pthread_mutex_lock(&pGroup->mutex);
+    rc = rc < 0 ? SQLITE_ERROR_SNAPSHOT : SQLITE_OK;
+    pGroup->rcBatch = rc;
+    pGroup->bCommitting = false;
+    pGroup->iBatchDone = iBatch;
+    pthread_cond_broadcast(&pGroup->cond);
+    pthread_mutex_unlock(&pGroup->mutex);
+
+    return rc;
+}
+
+static int auroraSlsStart(AuroraFile *p){
+    if (p->fd == 0)
+	return SQLITE_CANTOPEN;
+
+    if (sas_trace_start(p->fd) != 0)
+	return SQLITE_INTERNAL;
+
+    return SQLITE_OK;
+}
+
+/*
+** Take an SLS snapshot of the region, going through group commit if it
+** is enabled.
+*/
+static int auroraSlsCommit(AuroraFile *p){
+    if (p->pGroup != NULL)
+	return auroraGroupCommit(p->pGroup, p->nGroupCommitUs);
+
+    if (sas_trace_commit(p->fd) < 0)
+	return SQLITE_ERROR_SNAPSHOT;
+
+    return SQLITE_OK;
+}
+
+static void auroraSlsClose(AuroraFile *p){
+}
+
+/* The SLS snapshots the whole region by itself, so there is no xWrite. */
+static const AuroraBackend auroraSlsBackend = {
+    "sls",
+    auroraSlsStart,
+    NULL,
+    NULL,
+    auroraSlsCommit,
+    auroraSlsClose,
+};
+#endif /* AURORA_HAVE_SLS */
+
+/*
+** Write nByte bytes at iOfst of the backing file of backend=file.
+*/
+static int auroraImageWrite(AuroraFile *p, sqlite3_int64 iOfst, const void *aData, sqlite3_int64 nByte){
+    const unsigned char *a = aData;
+    ssize_t n;
+
+    while (nByte > 0) {
+	n = pwrite(p->fdImage, a, nByte, iOfst);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    return SQLITE_IOERR_WRITE;
+	a += n;
+	iOfst += n;
+	nByte -= n;
+    }
+
+    return SQLITE_OK;
+}
+
+/*
+** Make the file reflect the region from the start, since checkpoints
+** only write what changed.
+*/
+static int auroraImageStart(AuroraFile *p){
+    int rc;
+
+    p->fdImage = open(p->zImage, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (p->fdImage < 0)
+	return SQLITE_CANTOPEN;
+
+    if (p->bRestored)
+	return SQLITE_OK;
+
+    rc = auroraImageWrite(p, 0, p->aData, p->sz);
+    if (rc == SQLITE_OK && ftruncate(p->fdImage, p->sz) != 0)
+	rc = SQLITE_IOERR_TRUNCATE;
+    if (rc == SQLITE_OK && fdatasync(p->fdImage) != 0)
+	rc = SQLITE_IOERR_FSYNC;
+
+    if (rc != SQLITE_OK) {
+	close(p->fdImage);
+	p->fdImage = -1;
+    }
+
+    return rc;
+}
+
+/*
+** The dirty ranges are on their way to the file already, make them
+** durable along with the size of the image.
+*/
+static int auroraImageCommit(AuroraFile *p){
+    if (ftruncate(p->fdImage, p->szCkpt) != 0)
+	return SQLITE_IOERR_TRUNCATE;
+
+    if (fdatasync(p->fdImage) != 0)
+	return SQLITE_IOERR_FSYNC;
+
+    return SQLITE_OK;
+}
+
+static void auroraImageClose(AuroraFile *p){
+    if (p->fdImage >= 0)
+	close(p->fdImage);
+    p->fdImage = -1;
+}
+
+static const AuroraBackend auroraImageBackend = {
+    "file",
+    auroraImageStart,
+    auroraImageWrite,
+    NULL,
+    auroraImageCommit,
+    auroraImageClose,
+};
+
+#ifdef AURORA_HAVE_URING
+#define AURORA_URING_NBUF 32
+#define AURORA_URING_BUFSZ (256 * 1024)
+#define AURORA_URING_ALIGN 4096
+#define AURORA_URING_FSYNC AURORA_URING_NBUF
+
+/*
+** State of backend=uring. Ranges are copied into one of the registered
+** staging buffers, since the frozen image may change or go away once
+** xWrite() returns, and written from there. The flush threads share the
+** ring under the mutex, but copy into the buffers they took without it.
+**
+** All writes go through fdDirect, so that buffered and direct I/O never
+** mix on the image. O_DIRECT needs whole blocks: the tail of the image
+** is padded and truncated at commit, and dirty pages smaller than a
+** block turn it off.
+*/
+struct AuroraUring {
+    struct io_uring ring;           /* Submission and completion queues */
+    pthread_mutex_t mutex;          /* Protects the fields below */
+    pthread_cond_t cond;            /* Signals submitted writes */
+    int fdDirect;                   /* backendPath=, for all writes */
+    bool bDirect;                   /* Is fdDirect in O_DIRECT mode? */
+    unsigned char *aBuf;            /* The staging buffers, back to back */
+    unsigned int aLen[AURORA_URING_NBUF]; /* Bytes in flight per buffer */
+    int aFree[AURORA_URING_NBUF];   /* Indices of the idle buffers */
+    int nFree;                      /* Entries in aFree */
+    int nInflight;                  /* Operations not completed yet */
+    int rc;                         /* First error since the last commit */
+};
+
+/*
+** Reap a completion, waiting for one if there is none yet. Errors of
+** the operation are left in pUring->rc for the commit to report.
+*/
+static int auroraUringReap(AuroraUring *pUring){
+    struct io_uring_cqe *pCqe;
+    int iBuf;
+    int rc;
+
+    rc = io_uring_wait_cqe(&pUring->ring, &pCqe);
+    if (rc == -EINTR)
+	return SQLITE_OK;
+    if (rc != 0)
+	return SQLITE_IOERR;
+
+    iBuf = (int)(uintptr_t)io_uring_cqe_get_data(pCqe);
+    if (iBuf == AURORA_URING_FSYNC) {
+	if (pCqe->res < 0 && pUring->rc == SQLITE_OK)
+	    pUring->rc = SQLITE_IOERR_FSYNC;
+    } else {
+	if (pCqe->res != (int)pUring->aLen[iBuf] && pUring->rc == SQLITE_OK)
+	    pUring->rc = SQLITE_IOERR_WRITE;
+	pUring->aFree[pUring->nFree++] = iBuf;
+    }
+    pUring->nInflight -= 1;
+    io_uring_cqe_seen(&pUring->ring, pCqe);
+
+    return SQLITE_OK;
+}
+
+/*
+** Get a submission queue entry, making room if needed.
+*/
+static struct io_uring_sqe *auroraUringSqe(AuroraUring *pUring){
+    struct io_uring_sqe *pSqe;
+
+    while ((pSqe = io_uring_get_sqe(&pUring->ring)) == NULL)
+	io_uring_submit(&pUring->ring);
+
+    return pSqe;
+}
+
+/*
+** Take an idle staging buffer. If there is none, reap the writes in
+** flight, or wait for other flush threads to submit the buffers they
+** are copying into. The caller holds the mutex.
+*/
+static int auroraUringGetBuf(AuroraUring *pUring, int *piBuf){
+    int rc = SQLITE_OK;
+
+    while (pUring->nFree == 0 && rc == SQLITE_OK) {
+	if (pUring->nInflight > 0) {
+	    io_uring_submit(&pUring->ring);
+	    rc = auroraUringReap(pUring);
+	} else {
+	    pthread_cond_wait(&pUring->cond, &pUring->mutex);
+	}
+    }
+    if (rc == SQLITE_OK)
+	*piBuf = pUring->aFree[--pUring->nFree];
+
+    return rc;
+}
+
+/*
+** Queue nByte bytes at iOfst of the frozen image for writing. Only the
+** tail of the image may end off a block, and is padded up to one in
+** O_DIRECT mode.
+*/
+static int auroraUringWrite(AuroraFile *p, sqlite3_int64 iOfst, const void *aData, sqlite3_int64 nByte){
+    AuroraUring *pUring = p->pUring;
+    const unsigned char *a = aData;
+    struct io_uring_sqe *pSqe;
+    unsigned char *aBuf;
+    sqlite3_int64 n, nWrite;
+    int iBuf;
+    int rc = SQLITE_OK;
+
+    /* The dirty page size is only known once the file is open. */
+    pthread_mutex_lock(&pUring->mutex);
+    if (pUring->bDirect && (p->szDirtyPg & (AURORA_URING_ALIGN - 1)) != 0) {
+	if (fcntl(pUring->fdDirect, F_SETFL,
+		fcntl(pUring->fdDirect, F_GETFL) & ~O_DIRECT) != 0)
+	    rc = SQLITE_IOERR_WRITE;
+	else
+	    pUring->bDirect = false;
+    }
+    pthread_mutex_unlock(&pUring->mutex);
+
+    while (nByte > 0 && rc == SQLITE_OK) {
+	n = nByte < AURORA_URING_BUFSZ ? nByte : AURORA_URING_BUFSZ;
+	nWrite = n;
+	if (pUring->bDirect)
+	    nWrite = (n + AURORA_URING_ALIGN - 1) & ~(sqlite3_int64)(AURORA_URING_ALIGN - 1);
+
+	pthread_mutex_lock(&pUring->mutex);
+	rc = auroraUringGetBuf(pUring, &iBuf);
+	pthread_mutex_unlock(&pUring->mutex);
+	if (rc != SQLITE_OK)
+	    break;
+
+	aBuf = pUring->aBuf + (sqlite3_int64)iBuf * AURORA_URING_BUFSZ;
+	memcpy(aBuf, a, n);
+	memset(aBuf + n, 0, nWrite - n);
+
+	/* Get the write going while we copy the next chunk. */
+	pthread_mutex_lock(&pUring->mutex);
+	pUring->aLen[iBuf] = nWrite;
+	pSqe = auroraUringSqe(pUring);
+	io_uring_prep_write_fixed(pSqe, pUring->fdDirect, aBuf, nWrite, iOfst, iBuf);
+	io_uring_sqe_set_data(pSqe, (void *)(uintptr_t)iBuf);
+	pUring->nInflight += 1;
+	io_uring_submit(&pUring->ring);
+	pthread_cond_broadcast(&pUring->cond);
+	pthread_mutex_unlock(&pUring->mutex);
+
+	a += n;
+	iOfst += n;
+	nByte -= n;
+    }
+
+    return rc;
+}
+
+/*
+** Wait for the writes of the checkpoint, cut off the padding of the tail
+** and anything past the image, and fsync.
+*/
+static int auroraUringCommit(AuroraFile *p){
+    AuroraUring *pUring = p->pUring;
+    struct io_uring_sqe *pSqe;
+    int rc = SQLITE_OK;
+
+    pthread_mutex_lock(&pUring->mutex);
+    while (pUring->nInflight > 0 && rc == SQLITE_OK)
+	rc = auroraUringReap(pUring);
+
+    if (rc == SQLITE_OK && ftruncate(pUring->fdDirect, p->szCkpt) != 0)
+	rc = SQLITE_IOERR_TRUNCATE;
+
+    if (rc == SQLITE_OK) {
+	pSqe = auroraUringSqe(pUring);
+	io_uring_prep_fsync(pSqe, pUring->fdDirect, IORING_FSYNC_DATASYNC);
+	io_uring_sqe_set_data(pSqe, (void *)(uintptr_t)AURORA_URING_FSYNC);
+	pSqe->flags |= IOSQE_IO_DRAIN;
+	pUring->nInflight += 1;
+	io_uring_submit(&pUring->ring);
+    }
+
+    while (pUring->nInflight > 0 && rc == SQLITE_OK)
+	rc = auroraUringReap(pUring);
+
+    if (rc == SQLITE_OK)
+	rc = pUring->rc;
+    pUring->rc = SQLITE_OK;
+    pthread_mutex_unlock(&pUring->mutex);
+
+    return rc;
+}
+
+static void auroraUringClose(AuroraFile *p){
+    AuroraUring *pUring = p->pUring;
+
+    if (pUring != NULL) {
+	while (pUring->nInflight > 0 && auroraUringReap(pUring) == SQLITE_OK)
+	    ;
+	io_uring_queue_exit(&pUring->ring);
+	if (pUring->fdDirect >= 0)
+	    close(pUring->fdDirect);
+	free(pUring->aBuf);
+	pthread_cond_destroy(&pUring->cond);
+	pthread_mutex_destroy(&pUring->mutex);
+	sqlite3_free(pUring);
+	p->pUring = NULL;
+    }
+
+    auroraImageClose(p);
+}
+
+/*
+** Set up the file like backend=file does, and a ring with its staging
+** buffers registered. File systems without O_DIRECT, like tmpfs, get a
+** buffered fd instead.
+*/
+static int auroraUringStart(AuroraFile *p){
+    AuroraUring *pUring;
+    struct iovec aIov[AURORA_URING_NBUF];
+    int i;
+    int rc;
+
+    rc = auroraImageStart(p);
+    if (rc != SQLITE_OK)
+	return rc;
+
+    pUring = sqlite3_malloc(sizeof(*pUring));
+    if (pUring == NULL) {
+	auroraImageClose(p);
+	return SQLITE_NOMEM;
+    }
+
+    memset(pUring, 0, sizeof(*pUring));
+    pthread_mutex_init(&pUring->mutex, NULL);
+    pthread_cond_init(&pUring->cond, NULL);
+    p->pUring = pUring;
+
+    pUring->fdDirect = open(p->zImage, O_RDWR | O_DIRECT | O_CLOEXEC);
+    pUring->bDirect = pUring->fdDirect >= 0;
+    if (pUring->fdDirect < 0 && errno == EINVAL)
+	pUring->fdDirect = open(p->zImage, O_RDWR | O_CLOEXEC);
+    if (pUring->fdDirect < 0) {
+	rc = SQLITE_CANTOPEN;
+	goto error;
+    }
+
+    if (posix_memalign((void **)&pUring->aBuf, AURORA_URING_ALIGN,
+	(size_t)AURORA_URING_NBUF * AURORA_URING_BUFSZ) != 0) {
+	pUring->aBuf = NULL;
+	rc = SQLITE_NOMEM;
+	goto error;
+    }
+
+    for (i = 0; i < AURORA_URING_NBUF; i++) {
+	aIov[i].iov_base = pUring->aBuf + (sqlite3_int64)i * AURORA_URING_BUFSZ;
+	aIov[i].iov_len = AURORA_URING_BUFSZ;
+	pUring->aFree[i] = i;
+    }
+    pUring->nFree = AURORA_URING_NBUF;
+
+    /* One entry per buffer and one for the fsync, rounded up. */
+    if (io_uring_queue_init(2 * AURORA_URING_NBUF, &pUring->ring, 0) != 0) {
+	rc = SQLITE_CANTOPEN;
+	goto error;
+    }
+
+    if (io_uring_register_buffers(&pUring->ring, aIov, AURORA_URING_NBUF) != 0) {
+	io_uring_queue_exit(&pUring->ring);
+	rc = SQLITE_CANTOPEN;
+	goto error;
+    }
+
+    return SQLITE_OK;
+
+error:
+    if (pUring->fdDirect >= 0)
+	close(pUring->fdDirect);
+    free(pUring->aBuf);
+    pthread_cond_destroy(&pUring->cond);
+    pthread_mutex_destroy(&pUring->mutex);
+    sqlite3_free(pUring);
+    p->pUring = NULL;
+    auroraImageClose(p);
+
+    return rc;
+}
+
+static const AuroraBackend auroraUringBackend = {
+    "uring",
+    auroraUringStart,
+    auroraUringWrite,
+    NULL,
+    auroraUringCommit,
+    auroraUringClose,
+};
+#endif /* AURORA_HAVE_URING */
+
+/*
+** Write the frozen dirty ranges of the region, or all of it without
+** dirty tracking, to the image file and make them durable. Runs in the
+** child of backend=fork, so it must not lock or allocate anything.
+*/
+static int auroraForkWriteOut(AuroraFile *p){
+    sqlite3_int64 iPg = 0, iOfst, nByte;
+    int rc = SQLITE_OK;
+
+    if (p->szDirtyPg == 0)
+	rc = auroraImageWrite(p, 0, p->aData, p->szCkpt);
+    while (rc == SQLITE_OK && auroraDirtyNext(p, &iPg, &iOfst, &nByte))
+	rc = auroraImageWrite(p, iOfst, p->aData + iOfst, nByte);
+    if (rc == SQLITE_OK)
+	rc = auroraImageCommit(p);
+
+    return rc;
+}
+
+/*
+** Checkpoint from a forked child, which owns a copy-on-write copy of the
+** region as of the fork. Only the checkpointer thread waits for it, as
+** backend=fork is async only. The child reports back through a pipe
+** rather than its exit status, which a SIGCHLD handler of the
+** application may have collected.
+*/
+static int auroraForkCommit(AuroraFile *p){
+    int aPipe[2];
+    char c = 1;
+    ssize_t n;
+    pid_t pid;
+
+    if (p->szForkMax > 0 && p->szCkpt > p->szForkMax)
+	return auroraForkWriteOut(p);
+
+    /* Other threads may fork and exec while we wait on the pipe. */
+    if (pipe2(aPipe, O_CLOEXEC) != 0)
+	return auroraForkWriteOut(p);
+
+    /*
+     * The checkpointer thread holds the region, so we fork between
+     * transactions, keeping writers out for as long as fork() takes.
+     */
+    pid = fork();
+    if (pid == 0) {
+	close(aPipe[0]);
+	c = auroraForkWriteOut(p) == SQLITE_OK ? 0 : 1;
+	n = write(aPipe[1], &c, 1);
+	_exit(n == 1 ? 0 : 1);
+    }
+
+    close(aPipe[1]);
+    if (pid < 0) {
+	close(aPipe[0]);
+	return auroraForkWriteOut(p);
+    }
+
+    /* The child has its copy, writers can go on. */
+    auroraRegionUnhold(p);
+
+    do {
+	n = read(aPipe[0], &c, 1);
+    } while (n < 0 && errno == EINTR);
+    close(aPipe[0]);
+
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR)
+	;
+
+    return n == 1 && c == 0 ? SQLITE_OK : SQLITE_IOERR_WRITE;
+}
+
+/* The child does all the writing, so there is no xWrite. */
+static const AuroraBackend auroraForkBackend = {
+    "fork",
+    auroraImageStart,
+    NULL,
+    NULL,
+    auroraForkCommit,
+    auroraImageClose,
+};
+
+#define AURORA_LOG_BUFSZ (1024 * 1024)
+
+/*
+** State of backend=log. Records are gathered in aBuf and written to the
+** end of the log, fdImage, when it fills up or at commit. The flush
+** threads share it under the mutex.
+*/
+struct AuroraLog {
+    pthread_mutex_t mutex;          /* Protects the fields below */
+    unsigned char *aBuf;            /* Records not written yet */
+    int nBuf;                       /* Bytes in aBuf */
+    sqlite3_int64 iSize;            /* Size of the log, aBuf included */
+    sqlite3_uint64 iHash;           /* Hash of the checkpoint so far */
+    bool bTorn;                     /* Did writing the log fail? */
+};
+
+static sqlite3_uint64 auroraLogHash(sqlite3_uint64 iHash, const void *a, sqlite3_int64 nByte){
+    return iHash * 0x9e3779b97f4a7c15ULL + auroraHash(a, nByte);
+}
+
+/*
+** Write out the gathered records. If that fails, the log has a hole
+** that hides all later checkpoints from replay, so the next commit has
+** to start over with a snapshot.
+*/
+static int auroraLogFlush(AuroraFile *p, AuroraLog *pLog){
+    int rc;
+
+    rc = auroraImageWrite(p, pLog->iSize - pLog->nBuf, pLog->aBuf, pLog->nBuf);
+    pLog->nBuf = 0;
+    if (rc != SQLITE_OK)
+	pLog->bTorn = true;
+
+    return rc;
+}
+
+/*
+** Append a record with its payload to the log, adding it to the hash of
+** the checkpoint unless it is the commit record.
+*/
+static int auroraLogPut(AuroraFile *p, AuroraLog *pLog, const AuroraLogRec *pRec, const void *aPayload){
+    int rc = SQLITE_OK;
+
+    if (pRec->eEnc != AURORA_LOG_COMMIT) {
+	pLog->iHash = auroraLogHash(pLog->iHash, pRec, sizeof(*pRec));
+	pLog->iHash = auroraLogHash(pLog->iHash, aPayload, pRec->nPayload);
+    }
+
+    if (pLog->nBuf + sizeof(*pRec) + pRec->nPayload > AURORA_LOG_BUFSZ)
+	rc = auroraLogFlush(p, pLog);
+    if (rc != SQLITE_OK)
+	return rc;
+
+    memcpy(pLog->aBuf + pLog->nBuf, pRec, sizeof(*pRec));
+    pLog->nBuf += sizeof(*pRec);
+    pLog->iSize += sizeof(*pRec);
+
+    /* Payloads too large for the buffer go straight to the file. */
+    if (pLog->nBuf + pRec->nPayload > AURORA_LOG_BUFSZ) {
+	rc = auroraLogFlush(p, pLog);
+	if (rc == SQLITE_OK)
+	    rc = auroraImageWrite(p, pLog->iSize, aPayload, pRec->nPayload);
+	if (rc != SQLITE_OK)
+	    pLog->bTorn = true;
+    } else if (pRec->nPayload > 0) {
+	memcpy(pLog->aBuf + pLog->nBuf, aPayload, pRec->nPayload);
+	pLog->nBuf += pRec->nPayload;
+    }
+    pLog->iSize += pRec->nPayload;
+
+    return rc;
+}
+
+/*
+** End the checkpoint with a commit record for an image of sz bytes and
+** make the log durable.
+*/
+static int auroraLogCommitRec(AuroraFile *p, AuroraLog *pLog, sqlite3_int64 sz){
+    AuroraLogRec rec;
+    int rc;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.iOfst = sz;
+    rec.iHash = pLog->iHash;
+    rec.eEnc = AURORA_LOG_COMMIT;
+
+    rc = auroraLogPut(p, pLog, &rec, NULL);
+    if (rc == SQLITE_OK)
+	rc = auroraLogFlush(p, pLog);
+    if (rc == SQLITE_OK && fdatasync(p->fdImage) != 0) {
+	pLog->bTorn = true;
+	rc = SQLITE_IOERR_FSYNC;
+    }
+    pLog->iHash = 0;
+
+    return rc;
+}
+
+/*
+** Replace the log by a snapshot of the first sz bytes of the region: raw
+** records of all of it and a commit, written to a new file that is then
+** renamed over the log. Records that follow are relative to the
+** snapshot, so the delta bases start over.
+*/
+static int auroraLogSnapshot(AuroraFile *p, AuroraLog *pLog, sqlite3_int64 sz){
+    int fdLog = p->fdImage;
+    AuroraLogRec rec;
+    char *zTmp, *zDir;
+    sqlite3_int64 iOfst;
+    int fdDir;
+    int rc = SQLITE_OK;
+
+    zTmp = sqlite3_mprintf("%s-tmp", p->zImage);
+    if (zTmp == NULL)
+	return SQLITE_NOMEM;
+
+    p->fdImage = open(zTmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (p->fdImage < 0) {
+	p->fdImage = fdLog;
+	sqlite3_free(zTmp);
+	return SQLITE_CANTOPEN;
+    }
+
+    pLog->nBuf = 0;
+    pLog->iSize = 0;
+    pLog->iHash = 0;
+    memset(&rec, 0, sizeof(rec));
+    rec.eEnc = AURORA_ENC_RAW;
+    for (iOfst = 0; iOfst < sz && rc == SQLITE_OK; iOfst += AURORA_FLUSH_CHUNK) {
+	rec.iOfst = iOfst;
+	rec.nByte = sz - iOfst < AURORA_FLUSH_CHUNK ? sz - iOfst : AURORA_FLUSH_CHUNK;
+	rec.nPayload = rec.nDelta = rec.nByte;
+	rc = auroraLogPut(p, pLog, &rec, p->aData + iOfst);
+    }
+    if (rc == SQLITE_OK)
+	rc = auroraLogCommitRec(p, pLog, sz);
+    if (rc == SQLITE_OK && rename(zTmp, p->zImage) != 0)
+	rc = SQLITE_IOERR;
+
+    /* Make the rename durable too. */
+    if (rc == SQLITE_OK) {
+	zDir = sqlite3_mprintf("%s", p->zImage);
+	if (zDir != NULL && strrchr(zDir, '/') != NULL) {
+	    *strrchr(zDir, '/') = '\0';
+	    fdDir = open(zDir[0] != '\0' ? zDir : "/", O_RDONLY | O_CLOEXEC);
+	} else {
+	    fdDir = open(".", O_RDONLY | O_CLOEXEC);
+	}
+	if (fdDir >= 0) {
+	    fsync(fdDir);
+	    close(fdDir);
+	}
+	sqlite3_free(zDir);
+    }
+
+    if (rc != SQLITE_OK) {
+	close(p->fdImage);
+	unlink(zTmp);
+	p->fdImage = fdLog;
+	pLog->nBuf = 0;
+	pLog->iSize = fdLog >= 0 ? lseek(fdLog, 0, SEEK_END) : 0;
+	pLog->iHash = 0;
+	pLog->bTorn = true;
+    } else {
+	if (fdLog >= 0)
+	    close(fdLog);
+	pLog->bTorn = false;
+	auroraBaseReset(p);
+    }
+    sqlite3_free(zTmp);
+
+    return rc;
+}
+
+/*
+** Read the log from the start. Without bApply, find where the last
+** complete checkpoint ends, and the image size it committed; with
+** bApply, replay the records up to there into the region. Anything past
+** the last commit whose hash checks out is a torn tail.
+*/
+static int auroraLogScan(AuroraFile *p, bool bApply, sqlite3_int64 *piEnd, sqlite3_int64 *psz){
+    sqlite3_int64 iOfst = 0, iEnd = bApply ? *piEnd : -1;
+    unsigned char *aPayload = NULL, *aTmp = NULL;
+    sqlite3_uint64 iHash = 0;
+    sqlite3_int64 nAlloc = 0;
+    AuroraPageRec pageRec;
+    AuroraLogRec rec;
+    int rc = SQLITE_OK;
+
+    if (!bApply) {
+	*piEnd = 0;
+	*psz = 0;
+    }
+
+    while (!bApply || iOfst < iEnd) {
+	if (pread(p->fdImage, &rec, sizeof(rec), iOfst) != sizeof(rec))
+	    break;
+
+	if (rec.eEnc == AURORA_LOG_COMMIT) {
+	    iOfst += sizeof(rec);
+	    if (rec.iHash != iHash || rec.iOfst < 0 || rec.iOfst > p->szMax)
+		break;
+	    iHash = 0;
+	    if (!bApply) {
+		*piEnd = iOfst;
+		*psz = rec.iOfst;
+	    }
+	    continue;
+	}
+
+	if (rec.iOfst < 0 || rec.nByte <= 0 || rec.iOfst + rec.nByte > p->szMax ||
+	    rec.nPayload < 0 || rec.nDelta < 0 ||
+	    rec.nPayload > 2 * (sqlite3_int64)rec.nByte + 64 ||
+	    rec.nDelta > 2 * (sqlite3_int64)rec.nByte + 64)
+	    break;
+
+	if (rec.nPayload > nAlloc || rec.nDelta > nAlloc) {
+	    nAlloc = rec.nPayload > rec.nDelta ? rec.nPayload : rec.nDelta;
+	    sqlite3_free(aPayload);
+	    sqlite3_free(aTmp);
+	    aPayload = sqlite3_malloc64(nAlloc + 1);
+	    aTmp = sqlite3_malloc64(nAlloc + 1);
+	    if (aPayload == NULL || aTmp == NULL) {
+		rc = SQLITE_NOMEM;
+		break;
+	    }
+	}
+
+	if (pread(p->fdImage, aPayload, rec.nPayload, iOfst + sizeof(rec)) != rec.nPayload)
+	    break;
+	iHash = auroraLogHash(iHash, &rec, sizeof(rec));
+	iHash = auroraLogHash(iHash, aPayload, rec.nPayload);
+	iOfst += sizeof(rec) + rec.nPayload;
+
+	if (bApply) {
+	    pageRec.iOfst = rec.iOfst;
+	    pageRec.nByte = rec.nByte;
+	    pageRec.eEnc = rec.eEnc;
+	    pageRec.nPayload = rec.nPayload;
+	    pageRec.nDelta = rec.nDelta;
+	    rc = auroraPageRecApply(&pageRec, aPayload, p->aData + rec.iOfst, aTmp);
+	    if (rc != SQLITE_OK)
+		break;
+	}
+    }
+
+    sqlite3_free(aTmp);
+    sqlite3_free(aPayload);
+
+    return rc;
+}
+
+/*
+** Open the log. A region opened empty is restored from it, and either
+** way the log starts out as a snapshot of the region.
+*/
+static int auroraLogStart(AuroraFile *p){
+    AuroraLog *pLog;
+    sqlite3_int64 iEnd, sz;
+    int rc;
+
+    pLog = sqlite3_malloc(sizeof(*pLog));
+    if (pLog == NULL)
+	return SQLITE_NOMEM;
+    memset(pLog, 0, sizeof(*pLog));
+    pLog->aBuf = sqlite3_malloc(AURORA_LOG_BUFSZ);
+    if (pLog->aBuf == NULL) {
+	sqlite3_free(pLog);
+	return SQLITE_NOMEM;
+    }
+    pthread_mutex_init(&pLog->mutex, NULL);
+    p->pLog = pLog;
+
+    p->fdImage = open(p->zImage, O_RDONLY | O_CLOEXEC);
+    rc = SQLITE_OK;
+    if (p->fdImage >= 0 && p->sz == 0) {
+	rc = auroraLogScan(p, false, &iEnd, &sz);
+	if (rc == SQLITE_OK)
+	    rc = auroraLogScan(p, true, &iEnd, &sz);
+	if (rc == SQLITE_OK)
+	    p->sz = sz;
+    }
+
+    if (rc == SQLITE_OK)
+	rc = auroraLogSnapshot(p, pLog, p->sz);
+
+    return rc;
+}
+
+static int auroraLogAppend(AuroraFile *p, const AuroraPageRec *pRec, const void *aPayload){
+    AuroraLog *pLog = p->pLog;
+    AuroraLogRec rec;
+    int rc;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.iOfst = pRec->iOfst;
+    rec.nByte = pRec->nByte;
+    rec.eEnc = pRec->eEnc;
+    rec.nPayload = pRec->nPayload;
+    rec.nDelta = pRec->nDelta;
+
+    pthread_mutex_lock(&pLog->mutex);
+    rc = auroraLogPut(p, pLog, &rec, aPayload);
+    pthread_mutex_unlock(&pLog->mutex);
+
+    return rc;
+}
+
+/*
+** Replace the log by a snapshot of the region as it is now. Copy-on-write
+** only keeps the pages of the checkpoint, so we hold the region to take
+** it between transactions: the checkpointer may have let go of it after
+** the freeze, and in sync mode we are at the end of a transaction of our
+** own. The snapshot may be ahead of the page hashes, so forget those.
+*/
+static int auroraLogCompact(AuroraFile *p, AuroraLog *pLog){
+    bool bHeld = p->bRegionHeld, bWriter = false;
+    sqlite3_int64 sz;
+    int rc;
+
+    if (!bHeld) {
+	if (p->eCkptMode == AURORA_CKPT_SYNC) {
+	    bWriter = p->bRegionWriter;
+	    auroraRegionWriteEnd(p);
+	}
+	auroraRegionHold(p);
+    }
+
+    auroraCkptLock(p);
+    sz = p->sz;
+    auroraCkptUnlock(p);
+
+    rc = auroraLogSnapshot(p, pLog, sz);
+    if (rc == SQLITE_OK && p->aPageHash != NULL)
+	memset(p->aPageHash, 0,
+		(p->nDirtyWord * 64) * sizeof(sqlite3_uint64));
+
+    if (!bHeld) {
+	auroraRegionUnhold(p);
+	if (bWriter)
+	    auroraRegionWriteBegin(p);
+    }
+
+    return rc;
+}
+
+/*
+** Commit the checkpoint, compacting the log into a snapshot if it got
+** too long. A failed compaction leaves the log as it was.
+*/
+static int auroraLogCommit(AuroraFile *p){
+    AuroraLog *pLog = p->pLog;
+    sqlite3_int64 szMax;
+    int rc;
+
+    pthread_mutex_lock(&pLog->mutex);
+    if (pLog->bTorn) {
+	rc = auroraLogCompact(p, pLog);
+	pthread_mutex_unlock(&pLog->mutex);
+	return rc;
+    }
+
+    rc = auroraLogCommitRec(p, pLog, p->szCkpt);
+
+    szMax = p->szLogMax > 0 ? p->szLogMax : 2 * p->szCkpt;
+    if (rc == SQLITE_OK && pLog->iSize > szMax)
+	auroraLogCompact(p, pLog);
+    pthread_mutex_unlock(&pLog->mutex);
+
+    return rc;
+}
+
+static void auroraLogClose(AuroraFile *p){
+    AuroraLog *pLog = p->pLog;
+
+    if (pLog != NULL) {
+	pthread_mutex_destroy(&pLog->mutex);
+	sqlite3_free(pLog->aBuf);
+	sqlite3_free(pLog);
+	p->pLog = NULL;
+    }
+
+    auroraImageClose(p);
+}
+
+static const AuroraBackend auroraLogBackend = {
+    "log",
+    auroraLogStart,
+    NULL,
+    auroraLogAppend,
+    auroraLogCommit,
+    auroraLogClose,
+};
+
+#define AURORA_CACHELINE 64
+
+/*
+** Make nByte bytes at a of the region durable. On a DAX mapping writing
+** back their cache lines does, anywhere else the pages have to be
+** written back from the page cache with msync(), as they also are where
+** there is no cache line flush instruction.
+*/
+static int auroraPmemFlush(AuroraFile *p, const unsigned char *a, sqlite3_int64 nByte){
+    uintptr_t nPage = sysconf(_SC_PAGESIZE);
+    uintptr_t i;
+
+#if defined(__x86_64__) || defined(__i386__)
+    if (p->bPmemDax) {
+	uintptr_t iEnd = (uintptr_t)a + nByte;
+
+	for (i = (uintptr_t)a & ~(uintptr_t)(AURORA_CACHELINE - 1);
+		i < iEnd; i += AURORA_CACHELINE) {
+#if defined(__CLWB__)
+	    _mm_clwb((void *)i);
+#elif defined(__CLFLUSHOPT__)
+	    _mm_clflushopt((void *)i);
+#else
+	    _mm_clflush((void *)i);
+#endif
+	}
+
+	/* Flushes are only ordered against the fence of the same thread. */
+	_mm_sfence();
+	return SQLITE_OK;
+    }
+#endif
+
+    i = (uintptr_t)a & ~(nPage - 1);
+    if (msync((void *)i, (uintptr_t)a + nByte - i, MS_SYNC) != 0)
+	return SQLITE_IOERR_FSYNC;
+
+    return SQLITE_OK;
+}
+
+static int auroraPmemStart(AuroraFile *p){
+    return SQLITE_OK;
+}
+
+/*
+** The writes went to the persistent region itself, so what needs to be
+** flushed is the range of the region and not aData, which is a copy of
+** it for checkpoints that run with copy-on-write.
+*/
+static int auroraPmemWrite(AuroraFile *p, sqlite3_int64 iOfst, const void *aData, sqlite3_int64 nByte){
+    return auroraPmemFlush(p, p->aData + iOfst, nByte);
+}
+
+/* Every range was made durable by the thread that flushed it. */
+static int auroraPmemCommit(AuroraFile *p){
+    return SQLITE_OK;
+}
+
+static void auroraPmemClose(AuroraFile *p){
+}
+
+static const AuroraBackend auroraPmemBackend = {
+    "pmem",
+    auroraPmemStart,
+    auroraPmemWrite,
+    NULL,
+    auroraPmemCommit,
+    auroraPmemClose,
+};
+
+static int auroraNoneStart(AuroraFile *p){
+    return SQLITE_OK;
+}
+
+static int auroraNoneCommit(AuroraFile *p){
+    return SQLITE_OK;
+}
+
+static void auroraNoneClose(AuroraFile *p){
+}
+
+static const AuroraBackend auroraNoneBackend = {
+    "none",
+    auroraNoneStart,
+    NULL,
+    NULL,
+    auroraNoneCommit,
+    auroraNoneClose,
+};
+
+/* The backends for backend=, the first one being the default. */
+static const AuroraBackend *const auroraBackends[] = {
+#ifdef AURORA_HAVE_SLS
+    &auroraSlsBackend,
+#endif
+    &auroraImageBackend,
+#ifdef AURORA_HAVE_URING
+    &auroraUringBackend,
+#endif
+    &auroraPmemBackend,
+    &auroraForkBackend,
+    &auroraLogBackend,
+    &auroraNoneBackend,
+};
+
+/*
+** Find the backend called zName, or the default one if zName is NULL.
+*/
+static const AuroraBackend *auroraBackendFind(const char *zName){
+    size_t i;
+
+    if (zName == NULL)
+	return auroraBackends[0];
+
+    for (i = 0; i < sizeof(auroraBackends) / sizeof(auroraBackends[0]); i++) {
+	if (strcmp(auroraBackends[i]->zName, zName) == 0)
+	    return auroraBackends[i];
+    }
+
+    return NULL;
+}
+
+/*
+** Read nByte bytes at iOfst of the image into a, zeroing what is past
+** its end.
+*/
+static int auroraRestoreRead(int fd, unsigned char *a, sqlite3_int64 iOfst, sqlite3_int64 nByte){
+    ssize_t n;
+
+    while (nByte > 0) {
+	n = pread(fd, a, nByte, iOfst);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0)
+	    return SQLITE_IOERR_READ;
+	if (n == 0) {
+	    memset(a, 0, nByte);
+	    break;
+	}
+	a += n;
+	iOfst += n;
+	nByte -= n;
+    }
+
+    return SQLITE_OK;
+}
+
+#ifdef AURORA_HAVE_UFFD
+#define AURORA_RESTORE_CHUNK (64 * 1024)
+
+/*
+** A lazy restore. The region is registered with userfaultfd, and the
+** restore thread fills it a chunk at a time, those that were faulted on
+** first and then the rest in order. It unregisters the region and exits
+** once all of it is filled.
+*/
+struct AuroraRestore {
+    int uffd;                       /* The userfaultfd */
+    int fd;                         /* The image */
+    unsigned char *aData;           /* The region */
+    sqlite3_int64 sz;               /* Bytes to fill, a multiple of pages */
+    sqlite3_int64 szPage;           /* System page size */
+    unsigned char *aDone;           /* Filled flag per chunk */
+    sqlite3_int64 iNext;            /* Next chunk to prefill */
+    unsigned char *aBuf;            /* Chunk read from the image */
+    pthread_t thread;               /* The restore thread */
+    int rc;                         /* First error */
+};
+
+/*
+** Fill the chunk iChunk, unless it already is. Pages of it that were
+** mapped meanwhile, e.g. written to past the image, are left alone.
+*/
+static int auroraRestoreChunk(AuroraRestore *pRestore, sqlite3_int64 iChunk){
+    struct uffdio_copy copy;
+    sqlite3_int64 iOfst = iChunk * AURORA_RESTORE_CHUNK;
+    sqlite3_int64 nByte = AURORA_RESTORE_CHUNK, i;
+    int rc;
+
+    if (pRestore->aDone[iChunk])
+	return SQLITE_OK;
+
+    if (iOfst + nByte > pRestore->sz)
+	nByte = pRestore->sz - iOfst;
+    rc = auroraRestoreRead(pRestore->fd, pRestore->aBuf, iOfst, nByte);
+    if (rc != SQLITE_OK)
+	return rc;
+
+    for (i = 0; i < nByte; ) {
+	copy.dst = (uintptr_t)(pRestore->aData + iOfst + i);
+	copy.src = (uintptr_t)(pRestore->aBuf + i);
+	copy.len = nByte - i;
+	copy.mode = 0;
+	copy.copy = 0;
+	if (ioctl(pRestore->uffd, UFFDIO_COPY, &copy) == 0)
+	    break;
+	if (copy.copy > 0)
+	    i += copy.copy;
+	if (errno == EEXIST)
+	    i += pRestore->szPage;
+	else if (errno != EAGAIN && copy.copy <= 0)
+	    return SQLITE_IOERR;
+    }
+    pRestore->aDone[iChunk] = 1;
+
+    return SQLITE_OK;
+}
+
+/*
+** Serve the pending page faults.
+*/
+static int auroraRestoreFaults(AuroraRestore *pRestore){
+    struct uffd_msg msg;
+    struct uffdio_range range;
+    sqlite3_int64 iOfst;
+    int rc = SQLITE_OK;
+
+    while (rc == SQLITE_OK && read(pRestore->uffd, &msg, sizeof(msg)) == sizeof(msg)) {
+	if (msg.event != UFFD_EVENT_PAGEFAULT)
+	    continue;
+
+	iOfst = (unsigned char *)(uintptr_t)msg.arg.pagefault.address - pRestore->aData;
+	rc = auroraRestoreChunk(pRestore, iOfst / AURORA_RESTORE_CHUNK);
+
+	/* The chunk may have been filled before the fault was read. */
+	range.start = (uintptr_t)pRestore->aData + (iOfst & ~(pRestore->szPage - 1));
+	range.len = pRestore->szPage;
+	ioctl(pRestore->uffd, UFFDIO_WAKE, &range);
+    }
+
+    return rc;
+}
+
+static void *auroraRestoreThread(void *pArg){
+    AuroraRestore *pRestore = (AuroraRestore *)pArg;
+    sqlite3_int64 nChunk;
+    struct uffdio_range range;
+    struct pollfd pfd;
+    int rc = SQLITE_OK;
+
+    nChunk = (pRestore->sz + AURORA_RESTORE_CHUNK - 1) / AURORA_RESTORE_CHUNK;
+    pfd.fd = pRestore->uffd;
+    pfd.events = POLLIN;
+
+    while (pRestore->iNext < nChunk && rc == SQLITE_OK) {
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) > 0)
+	    rc = auroraRestoreFaults(pRestore);
+	if (rc == SQLITE_OK)
+	    rc = auroraRestoreChunk(pRestore, pRestore->iNext++);
+    }
+
+    /* On error, whoever faults afterwards gets zeroes rather than hang. */
+    range.start = (uintptr_t)pRestore->aData;
+    range.len = pRestore->sz;
+    ioctl(pRestore->uffd, UFFDIO_UNREGISTER, &range);
+    pRestore->rc = rc;
+
+    return NULL;
+}
+
+/*
+** Start a lazy restore of the first sz bytes of the region from the
+** image open at fd. Returns SQLITE_NOTFOUND if userfaultfd cannot be
+** used here.
+*/
+static int auroraRestoreLazy(AuroraFile *p, int fd, sqlite3_int64 sz){
+    AuroraRestore *pRestore;
+    struct uffdio_api api;
+    struct uffdio_register reg;
+    sqlite3_int64 szPage = sysconf(_SC_PAGESIZE);
+    sqlite3_int64 nChunk;
+
+    if (((uintptr_t)p->aData & (szPage - 1)) != 0)
+	return SQLITE_NOTFOUND;
+
+    pRestore = sqlite3_malloc(sizeof(*pRestore));
+    if (pRestore == NULL)
+	return SQLITE_NOMEM;
+    memset(pRestore, 0, sizeof(*pRestore));
+    pRestore->fd = fd;
+    pRestore->aData = p->aData;
+    pRestore->szPage = szPage;
+    pRestore->sz = (sz + szPage - 1) & ~(szPage - 1);
+    nChunk = (pRestore->sz + AURORA_RESTORE_CHUNK - 1) / AURORA_RESTORE_CHUNK;
+    pRestore->aDone = sqlite3_malloc64(nChunk);
+    pRestore->aBuf = sqlite3_malloc(AURORA_RESTORE_CHUNK);
+    if (pRestore->aDone == NULL || pRestore->aBuf == NULL) {
+	sqlite3_free(pRestore->aDone);
+	sqlite3_free(pRestore->aBuf);
+	sqlite3_free(pRestore);
+	return SQLITE_NOMEM;
+    }
+    memset(pRestore->aDone, 0, nChunk);
+
+    pRestore->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    memset(&api, 0, sizeof(api));
+    api.api = UFFD_API;
+    memset(&reg, 0, sizeof(reg));
+    reg.range.start = (uintptr_t)p->aData;
+    reg.range.len = pRestore->sz;
+    reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+    if (pRestore->uffd < 0 || ioctl(pRestore->uffd, UFFDIO_API, &api) != 0 ||
+	ioctl(pRestore->uffd, UFFDIO_REGISTER, &reg) != 0)
+	goto error;
+
+    if (pthread_create(&pRestore->thread, NULL, auroraRestoreThread, pRestore) != 0) {
+	ioctl(pRestore->uffd, UFFDIO_UNREGISTER, &reg.range);
+	goto error;
+    }
+
+    p->pRestore = pRestore;
+
+    return SQLITE_OK;
+
+error:
+    if (pRestore->uffd >= 0)
+	close(pRestore->uffd);
+    sqlite3_free(pRestore->aDone);
+    sqlite3_free(pRestore->aBuf);
+    sqlite3_free(pRestore);
+
+    return SQLITE_NOTFOUND;
+}
+
+/*
+** Wait for a lazy restore to complete, and release it.
+*/
+static int auroraRestoreFree(AuroraFile *p){
+    AuroraRestore *pRestore = p->pRestore;
+    int rc;
+
+    pthread_join(pRestore->thread, NULL);
+    rc = pRestore->rc;
+    close(pRestore->uffd);
+    close(pRestore->fd);
+    sqlite3_free(pRestore->aDone);
+    sqlite3_free(pRestore->aBuf);
+    sqlite3_free(pRestore);
+    p->pRestore = NULL;
+
+    return rc;
+}
+#endif /* AURORA_HAVE_UFFD */
+
+/*
+** Restore the region from the image of the file backends, for restore=.
+** Without an image there is nothing to restore.
+*/
+static int auroraRestore(AuroraFile *p, const char *zMode){
+    struct stat st;
+    int fd;
+    int rc;
+
+    if (strcmp(zMode, "eager") != 0 && strcmp(zMode, "lazy") != 0)
+	return SQLITE_CANTOPEN;
+
+    fd = open(p->zImage, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	return errno == ENOENT ? SQLITE_OK : SQLITE_CANTOPEN;
+
+    if (fstat(fd, &st) != 0 || st.st_size > p->szMax) {
+	close(fd);
+	return SQLITE_CANTOPEN;
+    }
+    p->sz = st.st_size;
+    p->bRestored = true;
+
+#ifdef AURORA_HAVE_UFFD
+    if (strcmp(zMode, "lazy") == 0) {
+	rc = auroraRestoreLazy(p, fd, p->sz);
+	if (rc != SQLITE_NOTFOUND) {
+	    if (rc != SQLITE_OK)
+		close(fd);
+	    return rc;
+	}
+    }
+#endif
+
+    rc = auroraRestoreRead(fd, p->aData, 0, p->sz);
+    close(fd);
+
+    return rc;
+}
+
+/*
+** Hand the frozen image of an aurora-file, nByte bytes having been written
+** to it since the last one, to the backend: write out its dirty ranges if
+** the backend wants them. The image is durable after xCommit.
+*/
+static int auroraPersist(AuroraFile *p, sqlite3_int64 nByte){
+    int rc = SQLITE_OK;
+
+    auroraHashFilter(p);
+
+    /*
+     * Backends without xWrite persist the image in one go, so charge
+     * the bandwidth limit for the whole checkpoint up front, by the
+     * dirty set if it is tracked.
+     */
+    if (p->pBackend->xWrite == NULL && p->pBackend->xAppend == NULL) {
+	if (p->szDirtyPg != 0)
+	    nByte = p->pCkptDirty->nPage * p->szDirtyPg;
+	auroraBucketTake(&p->bucket, nByte);
+    } else {
+	rc = auroraFlush(p);
+    }
+
+    return rc;
+}
+
+/* After a failed checkpoint we no longer know what is durable. */
+static void auroraCommitFailed(AuroraFile *p){
+    if (p->aPageHash != NULL)
+	memset(p->aPageHash, 0,
+		(p->nDirtyWord * 64) * sizeof(sqlite3_uint64));
+    auroraBaseReset(p);
+}
+
+/*
+** Persist the frozen image of an aurora-file, nByte bytes having been
+** written to it since the last one, and have the backend make it durable.
+*/
+static int auroraCommit(AuroraFile *p, sqlite3_int64 nByte){
+    int rc;
+
+    rc = auroraPersist(p, nByte);
+    if (rc == SQLITE_OK)
+	rc = p->pBackend->xCommit(p);
+
+    if (rc != SQLITE_OK)
+	auroraCommitFailed(p);
+
+    return rc;
+}
+
+/*
+** Run the durability callbacks whose epoch is now durable. If the
+** checkpointer failed, or bAll is set because the file is closing, run
+** all of them, passing the error to those that were not satisfied.
+*/
+static void auroraDurableNotify(AuroraFile *p, bool bAll){
+    AuroraDurableWaiter *pReady = NULL, **ppWaiter, *pWaiter;
+    sqlite3_uint64 iDone;
+    int rc;
+
+    pthread_mutex_lock(&p->ckptMutex);
+    iDone = p->iEpochDone;
+    rc = p->ckptRc;
+    if (rc == SQLITE_OK && bAll)
+	rc = SQLITE_ABORT;
+
+    ppWaiter = &p->pWaiters;
+    while ((pWaiter = *ppWaiter) != NULL) {
+	if (pWaiter->cb.iEpoch <= iDone || rc != SQLITE_OK) {
+	    *ppWaiter = pWaiter->pNext;
+	    pWaiter->pNext = pReady;
+	    pReady = pWaiter;
+	} else {
+	    ppWaiter = &pWaiter->pNext;
+	}
+    }
+    pthread_mutex_unlock(&p->ckptMutex);
+
+    while ((pWaiter = pReady) != NULL) {
+	pReady = pWaiter->pNext;
+	pWaiter->cb.xDurable(pWaiter->cb.pCtx, pWaiter->cb.iEpoch,
+		pWaiter->cb.iEpoch <= iDone ? SQLITE_OK : rc);
+	sqlite3_free(pWaiter);
+    }
+}
+
+/*
+** Body of the per-file checkpointer thread used in async mode. Requests
+** that pile up while a snapshot is in progress are all covered by the
+** next one, so the thread never falls more than one snapshot behind.
+*/
+static void *auroraCkptThread(void *pArg){
+    AuroraFile *p = (AuroraFile *)pArg;
+    sqlite3_int64 iDeadline, iStart, nByte;
+    sqlite3_uint64 iTarget;
+    struct timespec ts;
+    int rc;
+
+    pthread_mutex_lock(&p->ckptMutex);
+    for (;;) {
+	while ((p->iEpochDone == p->iEpoch || p->ckptRc != SQLITE_OK) &&
+		!p->bCkptExit) {
+	    if (p->nTickUs == 0 || p->ckptRc != SQLITE_OK) {
+		pthread_cond_wait(&p->ckptWork, &p->ckptMutex);
+		continue;
+	    }
+
+	    /* Poll the time-based policies while there is nothing to do. */
+	    iDeadline = auroraNowUs() + p->nTickUs;
+	    clock_gettime(CLOCK_REALTIME, &ts);
+	    ts.tv_sec += p->nTickUs / 1000000;
+	    ts.tv_nsec += (p->nTickUs % 1000000) * 1000;
+	    if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec += 1;
+		ts.tv_nsec -= 1000000000;
+	    }
+	    pthread_cond_timedwait(&p->ckptWork, &p->ckptMutex, &ts);
+
+	    if (auroraNowUs() >= iDeadline && auroraPolicyEvent(p, AURORA_EV_TICK, 0))
+		auroraEpochClose(p);
+	}
+
+	if (p->iEpochDone == p->iEpoch || p->ckptRc != SQLITE_OK)
+	    break;
+
+	/*
+	 * The connections go on writing while we checkpoint, so wait for
+	 * a point between their transactions to freeze the dirty set. Our
+	 * turn comes first, so that they do not queue up behind us while
+	 * other files checkpoint.
+	 */
+	nByte = p->szClosed;
+	pthread_mutex_unlock(&p->ckptMutex);
+	auroraSchedEnter(p, nByte);
+	auroraRegionHold(p);
+	pthread_mutex_lock(&p->ckptMutex);
+	iTarget = p->iEpoch;
+	nByte = p->szClosed;
+	p->szClosed = 0;
+	auroraDirtyFreeze(p);
+	pthread_mutex_unlock(&p->ckptMutex);
+
+	/*
+	 * Copy-on-write keeps the frozen pages for backends that persist
+	 * ranges. Others read the live region, which must stay put until
+	 * the snapshot is committed.
+	 */
+	if (p->bFrozen && (p->pBackend->xWrite != NULL || p->pBackend->xAppend != NULL))
+	    auroraRegionUnhold(p);
+
+	iStart = auroraNowUs();
+	rc = auroraCommit(p, nByte);
+	auroraRegionUnhold(p);
+	auroraSchedLeave();
+	if (rc != SQLITE_OK)
+	    auroraDirtyRetry(p);
+	auroraDirtyRelease(p);
+	if (rc == SQLITE_OK)
+	    auroraAdaptiveRecord(p, nByte, auroraNowUs() - iStart);
+
+	/*
+	 * A failed checkpoint is retried with the next request, so that
+	 * the file recovers once the backend does.
+	 */
+	pthread_mutex_lock(&p->ckptMutex);
+	if (rc == SQLITE_OK) {
+	    p->iEpochDone = iTarget;
+	    p->szUndurable -= nByte;
+	} else {
+	    p->szClosed += nByte;
+	    p->ckptRc = rc;
+	}
+	pthread_cond_broadcast(&p->ckptDone);
+	pthread_mutex_unlock(&p->ckptMutex);
+
+	auroraDurableNotify(p, false);
+
+	pthread_mutex_lock(&p->ckptMutex);
+    }
+    pthread_mutex_unlock(&p->ckptMutex);
+
+    return NULL;
+}
+
+/*
+** Start the checkpointer thread of an aurora-file opened in async mode.
+*/
+static int auroraCkptThreadStart(AuroraFile *p){
+    if (pthread_create(&p->ckptThread, NULL, auroraCkptThread, p) != 0)
+	return SQLITE_INTERNAL;
+
+    return SQLITE_OK;
+}
+
+/*
+** Let the checkpointer thread finish any outstanding snapshot and reap it.
+** Returns the first error the thread ran into, if any.
+*/
+static int auroraCkptThreadStop(AuroraFile *p){
+    pthread_mutex_lock(&p->ckptMutex);
+    p->bCkptExit = true;
+    pthread_cond_signal(&p->ckptWork);
+    pthread_mutex_unlock(&p->ckptMutex);
+
+    pthread_join(p->ckptThread, NULL);
+
+    return p->ckptRc;
+}
+
+/*
+** Checkpoint the sync-mode aurora-files linked from pList by pGroupNext
+** that were written to, as one epoch with a single commit. A lone file
+** has no pGroupNext.
+*/
+static int auroraCheckpointSync(AuroraFile *pList){
+    sqlite3_int64 iStart, nByte = 0;
+    AuroraFile *p;
+    int rc = SQLITE_OK;
+
+    for (p = pList; p != NULL; p = p->pGroupNext) {
+	p->bInCkpt = p->szWritten > 0 || p->pCkptGroup == NULL;
+	if (!p->bInCkpt)
+	    continue;
+
+	auroraEpochClose(p);
+	nByte += p->szClosed;
+	auroraDirtyFreeze(p);
+    }
+
+    auroraSchedEnter(pList, nByte);
+    iStart = auroraNowUs();
+    for (p = pList; p != NULL && rc == SQLITE_OK; p = p->pGroupNext) {
+	if (p->bInCkpt)
+	    rc = auroraPersist(p, p->szClosed);
+    }
+    if (rc == SQLITE_OK)
+	rc = pList->pBackend->xCommit(pList);
+    auroraSchedLeave();
+
+    for (p = pList; p != NULL; p = p->pGroupNext) {
+	if (!p->bInCkpt)
+	    continue;
+
+	/*
+	 * A failed epoch is left to the next checkpoint, which must
+	 * persist its pages again and count them as written.
+	 */
+	if (rc != SQLITE_OK) {
+	    auroraDirtyRetry(p);
+	    p->szWritten += p->szClosed;
+	}
+	auroraDirtyRelease(p);
+	if (rc != SQLITE_OK) {
+	    auroraCommitFailed(p);
+	} else {
+	    auroraAdaptiveRecord(p, p->szClosed, auroraNowUs() - iStart);
+
+	    pthread_mutex_lock(&p->ckptMutex);
+	    p->iEpochDone = p->iEpoch;
+	    p->szUndurable -= p->szClosed;
+	    pthread_mutex_unlock(&p->ckptMutex);
+	}
+
+	p->szClosed = 0;
+	p->bInCkpt = false;
+    }
+
+    return rc;
+}
+
+/*
+** Ask for a checkpoint of the group of an aurora-file. It is taken right
+** away if no file of the group is in a write transaction, otherwise when
+** the last one ends.
+*/
+static int auroraCkptGroupRequest(AuroraCkptGroup *pGroup){
+    int rc = SQLITE_OK;
+
+    pthread_mutex_lock(&pGroup->mutex);
+    pGroup->bPending = true;
+    if (pGroup->nWriter == 0) {
+	pGroup->bPending = false;
+	rc = auroraCheckpointSync(pGroup->pFiles);
+    }
+    pthread_mutex_unlock(&pGroup->mutex);
+
+    return rc;
+}
+
+/*
+** Track whether an aurora-file of a checkpoint group is in a write
+** transaction, taking the pending group checkpoint when the last one of
+** the group ends.
+*/
+static int auroraCkptGroupLock(AuroraFile *p, int eLock){
+    AuroraCkptGroup *pGroup = p->pCkptGroup;
+    bool bWriter = eLock >= SQLITE_LOCK_RESERVED;
+    int rc = SQLITE_OK;
+
+    pthread_mutex_lock(&pGroup->mutex);
+    if (bWriter != p->bGroupWriter) {
+	pGroup->nWriter += bWriter ? 1 : -1;
+	p->bGroupWriter = bWriter;
+    }
+
+    if (pGroup->nWriter == 0 && pGroup->bPending) {
+	pGroup->bPending = false;
+	rc = auroraCheckpointSync(pGroup->pFiles);
+    }
+    pthread_mutex_unlock(&pGroup->mutex);
+
+    return rc;
+}
+
+/*
+** Add an aurora-file to the checkpoint group zName, creating it if
+** needed. All files of a group must share their fd and backend.
+*/
+static int auroraCkptGroupJoin(AuroraFile *p, const char *zName){
+    AuroraCkptGroup *pGroup;
+
+    pthread_mutex_lock(&auroraCkptGroupMutex);
+    for (pGroup = auroraCkptGroupList; pGroup != NULL; pGroup = pGroup->pNext) {
+	if (strcmp(pGroup->zName, zName) == 0)
+	    break;
+    }
+
+    if (pGroup == NULL) {
+	pGroup = sqlite3_malloc(sizeof(*pGroup) + strlen(zName) + 1);
+	if (pGroup == NULL) {
+	    pthread_mutex_unlock(&auroraCkptGroupMutex);
+	    return SQLITE_NOMEM;
+	}
+
+	memset(pGroup, 0, sizeof(*pGroup));
+	pGroup->zName = (char *)&pGroup[1];
+	strcpy(pGroup->zName, zName);
+	pGroup->fd = p->fd;
+	pGroup->pBackend = p->pBackend;
+	pthread_mutex_init(&pGroup->mutex, NULL);
+	pGroup->pNext = auroraCkptGroupList;
+	auroraCkptGroupList = pGroup;
+    } else if (pGroup->fd != p->fd || pGroup->pBackend != p->pBackend) {
+	pthread_mutex_unlock(&auroraCkptGroupMutex);
+	return SQLITE_CANTOPEN;
+    }
+
+    pGroup->nRef += 1;
+    pthread_mutex_lock(&pGroup->mutex);
+    p->pGroupNext = pGroup->pFiles;
+    pGroup->pFiles = p;
+    pthread_mutex_unlock(&pGroup->mutex);
+    pthread_mutex_unlock(&auroraCkptGroupMutex);
+
+    p->pCkptGroup = pGroup;
+
+    return SQLITE_OK;
+}
+
+/*
+** Remove an aurora-file from its checkpoint group, freeing the group with
+** its last file.
+*/
+static void auroraCkptGroupLeave(AuroraFile *p){
+    AuroraCkptGroup *pGroup = p->pCkptGroup;
+    AuroraCkptGroup **ppGroup;
+    AuroraFile **pp;
+
+    pthread_mutex_lock(&auroraCkptGroupMutex);
+    pthread_mutex_lock(&pGroup->mutex);
+    for (pp = &pGroup->pFiles; *pp != p; pp = &(*pp)->pGroupNext)
+	;
+    *pp = p->pGroupNext;
+    if (p->bGroupWriter)
+	pGroup->nWriter -= 1;
+    pthread_mutex_unlock(&pGroup->mutex);
+
+    p->pCkptGroup = NULL;
+    p->pGroupNext = NULL;
+    p->bGroupWriter = false;
+
+    pGroup->nRef -= 1;
+    if (pGroup->nRef > 0) {
+	pthread_mutex_unlock(&auroraCkptGroupMutex);
+	return;
+    }
+
+    for (ppGroup = &auroraCkptGroupList; *ppGroup != pGroup; ppGroup = &(*ppGroup)->pNext)
+	;
+    *ppGroup = pGroup->pNext;
+    pthread_mutex_unlock(&auroraCkptGroupMutex);
+
+    pthread_mutex_destroy(&pGroup->mutex);
+    sqlite3_free(pGroup);
+}
+
+/*
+** Close the epoch of an aurora-file in async mode and wake up the
+** checkpointer, which also retries a checkpoint that failed. The caller
+** holds ckptMutex.
+*/
+static void auroraCkptRequest(AuroraFile *p){
+    auroraEpochClose(p);
+    p->ckptRc = SQLITE_OK;
+    pthread_cond_signal(&p->ckptWork);
+}
+
+/*
+** Checkpoint an aurora-file. In sync mode the snapshot is taken before
+** returning, unless the file is in a checkpoint group. In async mode we
+** only open a new epoch and wake up the checkpointer, blocking just if
+** we are more than nMaxLag epochs ahead of the last completed
+** checkpoint. That also retries the epochs of a checkpoint that failed.
+*/
+static int auroraCheckpoint(AuroraFile *p){
+    bool bLag, bWriter;
+    int rc;
+
+    if (p->pCkptGroup != NULL)
+	return auroraCkptGroupRequest(p->pCkptGroup);
+
+    if (p->eCkptMode == AURORA_CKPT_SYNC) {
+	auroraRegionCkptBegin(p);
+	rc = auroraCheckpointSync(p);
+	auroraRegionCkptEnd(p);
+	return rc;
+    }
+
+    pthread_mutex_lock(&p->ckptMutex);
+    auroraCkptRequest(p);
+    bLag = p->iEpoch - p->iEpochDone > p->nMaxLag;
+    pthread_mutex_unlock(&p->ckptMutex);
+
+    if (!bLag)
+	return SQLITE_OK;
+
+    /*
+     * We are called between transactions, or with the pages of the one
+     * that commits all in place. The checkpointer may have to wait for
+     * that, so do not count as a writer while we wait for it.
+     */
+    bWriter = p->bRegionWriter;
+    auroraRegionWriteEnd(p);
+
+    pthread_mutex_lock(&p->ckptMutex);
+    while (p->iEpoch - p->iEpochDone > p->nMaxLag && p->ckptRc == SQLITE_OK)
+	pthread_cond_wait(&p->ckptDone, &p->ckptMutex);
+    rc = p->ckptRc;
+    pthread_mutex_unlock(&p->ckptMutex);
+
+    if (bWriter)
+	auroraRegionWriteBegin(p);
+
+    return rc;
+}
+
+/*
+** The epoch holding the latest write: the open one if anything was
+** written since the last checkpoint, else the last closed one.
+*/
+static sqlite3_uint64 auroraEpochWritten(AuroraFile *p){
+    sqlite3_uint64 iEpoch;
+
+    auroraCkptLock(p);
+    iEpoch = p->iEpoch + (p->szWritten > 0 ? 1 : 0);
+    auroraCkptUnlock(p);
+
+    return iEpoch;
+}
+
+/*
+** Is epoch iEpoch still open, i.e. not yet handed to a checkpoint?
+*/
+static bool auroraEpochIsOpen(AuroraFile *p, sqlite3_uint64 iEpoch){
+    bool bOpen;
+
+    auroraCkptLock(p);
+    bOpen = iEpoch > p->iEpoch;
+    auroraCkptUnlock(p);
+
+    return bOpen;
+}
+
+/*
+** Did the last checkpoint of an aurora-file in async mode fail?
+*/
+static bool auroraCkptFailed(AuroraFile *p){
+    bool bFailed;
+
+    pthread_mutex_lock(&p->ckptMutex);
+    bFailed = p->ckptRc != SQLITE_OK;
+    pthread_mutex_unlock(&p->ckptMutex);
+
+    return bFailed;
+}
+
+/*
+** Block until epoch iEpoch of an aurora-file is durable, closing it first
+** if it is still open.
+*/
+static int auroraWaitDurable(AuroraFile *p, sqlite3_uint64 iEpoch){
+    int rc = SQLITE_OK;
+
+    if (iEpoch > auroraEpochWritten(p))
+	return SQLITE_RANGE;
+
+    /*
+     * In sync mode a failed checkpoint leaves the epoch to the next one.
+     * The checkpoint of a group may have to wait for its transactions.
+     */
+    if (p->eCkptMode == AURORA_CKPT_SYNC) {
+	if (p->iEpochDone < iEpoch)
+	    rc = auroraCheckpoint(p);
+	if (rc == SQLITE_OK && p->iEpochDone < iEpoch)
+	    rc = SQLITE_BUSY;
+	return rc;
+    }
+
+    /* The checkpointer would wait for our transaction to end. */
+    if (p->bRegionWriter) {
+	pthread_mutex_lock(&p->ckptMutex);
+	if (p->iEpochDone < iEpoch)
+	    rc = SQLITE_BUSY;
+	pthread_mutex_unlock(&p->ckptMutex);
+	return rc;
+    }
+
+    /* A failed checkpoint gets another chance. */
+    if (auroraEpochIsOpen(p, iEpoch) || auroraCkptFailed(p)) {
+	rc = auroraCheckpoint(p);
+	if (rc != SQLITE_OK)
+	    return rc;
+    }
+
+    pthread_mutex_lock(&p->ckptMutex);
+    while (p->iEpochDone < iEpoch && p->ckptRc == SQLITE_OK)
+	pthread_cond_wait(&p->ckptDone, &p->ckptMutex);
+    if (p->iEpochDone < iEpoch)
+	rc = p->ckptRc;
+    pthread_mutex_unlock(&p->ckptMutex);
+
+    return rc;
+}
+
+/*
+** Arrange for a callback once an epoch is durable. In sync mode, or if
+** the epoch is already durable, the callback runs before we return.
+*/
+static int auroraOnDurable(AuroraFile *p, AuroraDurableCallback *pCb){
+    AuroraDurableWaiter *pWaiter;
+    int rc = SQLITE_OK;
+
+    if (pCb->xDurable == NULL)
+	return SQLITE_MISUSE;
+
+    if (pCb->iEpoch > auroraEpochWritten(p))
+	return SQLITE_RANGE;
+
+    if (p->eCkptMode == AURORA_CKPT_SYNC) {
+	rc = auroraWaitDurable(p, pCb->iEpoch);
+	pCb->xDurable(pCb->pCtx, pCb->iEpoch, rc);
+	return SQLITE_OK;
+    }
+
+    pWaiter = sqlite3_malloc(sizeof(*pWaiter));
+    if (pWaiter == NULL)
+	return SQLITE_NOMEM;
+    pWaiter->cb = *pCb;
+
+    pthread_mutex_lock(&p->ckptMutex);
+    if (pCb->iEpoch > p->iEpoch)
+	auroraCkptRequest(p);
+    pWaiter->pNext = p->pWaiters;
+    p->pWaiters = pWaiter;
+    pthread_mutex_unlock(&p->ckptMutex);
+
+    /* The checkpointer may have gotten there first. */
+    auroraDurableNotify(p, false);
+
+    return SQLITE_OK;
+}
+
+/*
+** Add an aurora-file to the files on its region, creating the region if
+** needed.
+*/
+static int auroraRegionJoin(AuroraFile *p){
+    AuroraRegion *pRegion;
+
+    pthread_mutex_lock(&auroraRegionMutex);
+    for (pRegion = auroraRegionList; pRegion != NULL; pRegion = pRegion->pNext) {
+	if (pRegion->aData == p->aData)
+	    break;
+    }
+
+    if (pRegion == NULL) {
+	pRegion = sqlite3_malloc(sizeof(*pRegion));
+	if (pRegion == NULL) {
+	    pthread_mutex_unlock(&auroraRegionMutex);
+	    return SQLITE_NOMEM;
+	}
+
+	memset(pRegion, 0, sizeof(*pRegion));
+	pRegion->aData = p->aData;
+	pthread_mutex_init(&pRegion->mutex, NULL);
+	pthread_cond_init(&pRegion->cond, NULL);
+	pRegion->pNext = auroraRegionList;
+	auroraRegionList = pRegion;
+    }
+
+    pRegion->nRef += 1;
+    pthread_mutex_lock(&pRegion->mutex);
+    p->pRegionNext = pRegion->pFiles;
+    pRegion->pFiles = p;
+    pthread_mutex_unlock(&pRegion->mutex);
+    pthread_mutex_unlock(&auroraRegionMutex);
+
+    p->pRegion = pRegion;
+
+    return SQLITE_OK;
+}
+
+/*
+** Remove an aurora-file from its region, freeing the region with its last
+** file.
+*/
+static void auroraRegionLeave(AuroraFile *p){
+    AuroraRegion *pRegion = p->pRegion;
+    AuroraRegion **ppRegion;
+    AuroraFile **pp;
+
+    /* A freeze may be making the file durable. */
+    pthread_mutex_lock(&pRegion->mutex);
+    while (pRegion->bFreezing)
+	pthread_cond_wait(&pRegion->cond, &pRegion->mutex);
+    for (pp = &pRegion->pFiles; *pp != p; pp = &(*pp)->pRegionNext)
+	;
+    *pp = p->pRegionNext;
+    if (p->bRegionWriter) {
+	pRegion->nWriter -= 1;
+	pthread_cond_broadcast(&pRegion->cond);
+    }
+    pthread_mutex_unlock(&pRegion->mutex);
+
+    p->pRegion = NULL;
+    p->pRegionNext = NULL;
+    p->bRegionWriter = false;
+
+    pthread_mutex_lock(&auroraRegionMutex);
+    pRegion->nRef -= 1;
+    if (pRegion->nRef > 0) {
+	pthread_mutex_unlock(&auroraRegionMutex);
+	return;
+    }
+
+    for (ppRegion = &auroraRegionList; *ppRegion != pRegion; ppRegion = &(*ppRegion)->pNext)
+	;
+    *ppRegion = pRegion->pNext;
+    pthread_mutex_unlock(&auroraRegionMutex);
+
+    pthread_cond_destroy(&pRegion->cond);
+    pthread_mutex_destroy(&pRegion->mutex);
+    sqlite3_free(pRegion);
+}
+
+/*
+** Make everything written to an aurora-file durable for auroraFreeze().
+** Sync mode checkpoints are taken here, on behalf of the connection,
+** which auroraRegionCkptBegin() keeps out meanwhile. Checkpoints of
+** groups and in async mode are safe to request from any thread.
+*/
+static int auroraFreezeDurable(AuroraFile *p){
+    sqlite3_uint64 iEpoch = auroraEpochWritten(p);
+    int rc = SQLITE_OK;
+
+    if (p->eCkptMode != AURORA_CKPT_SYNC || p->pCkptGroup != NULL)
+	return auroraWaitDurable(p, iEpoch);
+
+    if (p->iEpochDone < iEpoch)
+	rc = auroraCheckpointSync(p);
+    if (rc == SQLITE_OK && p->iEpochDone < iEpoch)
+	rc = SQLITE_BUSY;
+
+    return rc;
+}
+
+/*
+** Freeze the region of an aurora-file for an external snapshot: keep new
+** writers out, wait for the running ones to end and make what they wrote
+** durable, for every file on the region. The freeze lifts itself after
+** nMaxFreezeUs, so a snapshot tool that dies cannot stall the database
+** for good.
+*/
+static int auroraFreeze(AuroraFile *p, AuroraFreeze *pFreeze){
+    AuroraRegion *pRegion = p->pRegion;
+    AuroraFile *pFile;
+    sqlite3_int64 iNow;
+    int rc = SQLITE_OK;
+
+    if (pFreeze->nMaxFreezeUs <= 0)
+	return SQLITE_MISUSE;
+
+    /* We would wait for ourselves. */
+    if (p->bRegionWriter)
+	return SQLITE_BUSY;
+
+    pthread_mutex_lock(&pRegion->mutex);
+    iNow = auroraNowUs();
+    if (pRegion->bFrozen && iNow < pRegion->iThawUs) {
+	pthread_mutex_unlock(&pRegion->mutex);
+	return SQLITE_BUSY;
+    }
+
+    pRegion->bFrozen = true;
+    pRegion->iThawUs = iNow + pFreeze->nMaxFreezeUs;
+    while ((pRegion->nWriter > 0 || pRegion->nCkpt > 0) &&
+	(iNow = auroraNowUs()) < pRegion->iThawUs)
+	auroraCondWaitUs(&pRegion->cond, &pRegion->mutex, pRegion->iThawUs - iNow);
+    if (pRegion->nWriter > 0 || pRegion->nCkpt > 0)
+	rc = SQLITE_BUSY;
+
+    /*
+     * While bFreezing is set the files cannot close under us, nor take
+     * sync checkpoints of their own, so we can drop the region mutex
+     * for the checkpoints. The freeze may overrun by the time these
+     * take, as nothing changes the region until it is thawed.
+     */
+    if (rc == SQLITE_OK) {
+	pRegion->bFreezing = true;
+	pthread_mutex_unlock(&pRegion->mutex);
+
+	for (pFile = pRegion->pFiles; pFile != NULL && rc == SQLITE_OK;
+	    pFile = pFile->pRegionNext)
+	    rc = auroraFreezeDurable(pFile);
+
+	pthread_mutex_lock(&pRegion->mutex);
+	pRegion->bFreezing = false;
+	pthread_cond_broadcast(&pRegion->cond);
+    }
+
+    if (rc == SQLITE_OK && auroraNowUs() >= pRegion->iThawUs)
+	rc = SQLITE_BUSY;
+
+    if (rc != SQLITE_OK) {
+	pRegion->bFrozen = false;
+	pthread_cond_broadcast(&pRegion->cond);
+    } else {
+	pFreeze->pData = p->aData;
+	pFreeze->sz = p->sz;
+	auroraCkptLock(p);
+	pFreeze->iEpoch = p->iEpochDone;
+	auroraCkptUnlock(p);
+    }
+    pthread_mutex_unlock(&pRegion->mutex);
+
+    return rc;
+}
+
+/*
+** Thaw the region of an aurora-file. Returns SQLITE_ABORT if the freeze
+** had expired, as writers may have changed the region since.
+*/
+static int auroraThaw(AuroraFile *p){
+    AuroraRegion *pRegion = p->pRegion;
+    int rc = SQLITE_OK;
+
+    pthread_mutex_lock(&pRegion->mutex);
+    if (!pRegion->bFrozen)
+	rc = SQLITE_MISUSE;
+    else if (auroraNowUs() >= pRegion->iThawUs)
+	rc = SQLITE_ABORT;
+    pRegion->bFrozen = false;
+    pthread_cond_broadcast(&pRegion->cond);
+    pthread_mutex_unlock(&pRegion->mutex);
+
+    return rc;
+}
+
+/*
+** Populate a part of the region for writing. Touching the pages is the
+** fallback, with an atomic no-op so as not to race with writers of the
+** region.
+*/
+static void auroraPopulate(unsigned char *a, sqlite3_int64 nByte){
+    sqlite3_int64 szPage = sysconf(_SC_PAGESIZE);
+    sqlite3_int64 i;
+
+#ifdef MADV_POPULATE_WRITE
+    if (madvise(a, nByte, MADV_POPULATE_WRITE) != 0)
+#endif
+    for (i = 0; i < nByte; i += szPage)
+	__atomic_fetch_or(&a[i], 0, __ATOMIC_RELAXED);
+}
+
+static void *auroraPrefaultThread(void *pArg){
+    AuroraPrefaultJob *pJob = (AuroraPrefaultJob *)pArg;
+
+    auroraPopulate(pJob->a, pJob->nByte);
+    if (pJob->bLock)
+	pJob->bLocked = mlock(pJob->a, pJob->nByte) == 0;
+
+    return NULL;
+}
+
+/*
+** Populate the region up to its current size with nThread threads, each
+** taking a contiguous part, and record how long that took.
+*/
+static int auroraPrefault(AuroraFile *p, int nThread, bool bLock){
+    AuroraPrefaultJob aJob[AURORA_MAX_PREFAULT_THREADS];
+    pthread_t aThread[AURORA_MAX_PREFAULT_THREADS];
+    sqlite3_int64 szPage = sysconf(_SC_PAGESIZE);
+    uintptr_t iStart, iEnd;
+    sqlite3_int64 nPage, nEach, iStartUs;
+    int i, nStarted;
+    bool bLocked = bLock;
+
+    iStartUs = auroraNowUs();
+    iStart = (uintptr_t)p->aData & ~(uintptr_t)(szPage - 1);
+    iEnd = ((uintptr_t)p->aData + p->sz + szPage - 1) & ~(uintptr_t)(szPage - 1);
+    nPage = (iEnd - iStart) / szPage;
+    if (nThread > nPage)
+	nThread = nPage > 0 ? nPage : 1;
+    nEach = (nPage + nThread - 1) / nThread;
+
+    for (i = 0; i < nThread; i++) {
+	aJob[i].a = (unsigned char *)iStart + i * nEach * szPage;
+	aJob[i].nByte = nEach * szPage;
+	if (aJob[i].a + aJob[i].nByte > (unsigned char *)iEnd)
+	    aJob[i].nByte = (unsigned char *)iEnd - aJob[i].a;
+	if (aJob[i].nByte < 0)
+	    aJob[i].nByte = 0;
+	aJob[i].bLock = bLock;
+	aJob[i].bLocked = false;
+    }
+
+    /* The first part is ours. */
+    for (nStarted = 1; nStarted < nThread; nStarted++) {
+	if (pthread_create(&aThread[nStarted], NULL, auroraPrefaultThread, &aJob[nStarted]) != 0)
+	    break;
+    }
+    for (i = nStarted; i < nThread; i++)
+	auroraPrefaultThread(&aJob[i]);
+    auroraPrefaultThread(&aJob[0]);
+
+    for (i = 1; i < nStarted; i++)
+	pthread_join(aThread[i], NULL);
+
+    for (i = 0; i < nThread; i++)
+	bLocked = bLocked && aJob[i].bLocked;
+
+    p->prefault.nThread = nThread;
+    p->prefault.szPrefault = iEnd - iStart;
+    p->prefault.nUs = auroraNowUs() - iStartUs;
+    p->prefault.bLocked = bLocked;
+
+    return SQLITE_OK;
+}
+
+/*
+** Record a read at iOfst in the hot set, if it is sampled. Only the first
+** read recorded in a chunk takes the mutex.
+*/
+static void auroraHotRecord(AuroraHot *pHot, sqlite3_int64 iOfst){
+    sqlite3_int64 iChunk = iOfst / AURORA_HOT_CHUNK;
+    sqlite3_uint64 mask = 1ULL << (iChunk % 64);
+    uint32_t *aNew;
+
+    if (++pHot->nTick < pHot->nSample)
+	return;
+    pHot->nTick = 0;
+
+    if (iChunk >= pHot->nChunk)
+	return;
+    if (__atomic_load_n(&pHot->aSeen[iChunk / 64], __ATOMIC_RELAXED) & mask)
+	return;
+    if (__atomic_fetch_or(&pHot->aSeen[iChunk / 64], mask, __ATOMIC_RELAXED) & mask)
+	return;
+
+    pthread_mutex_lock(&pHot->mutex);
+    if (pHot->nOrder == pHot->nAlloc) {
+	aNew = sqlite3_realloc64(pHot->aOrder,
+	    (pHot->nAlloc * 2 + 64) * sizeof(uint32_t));
+	if (aNew != NULL) {
+	    pHot->aOrder = aNew;
+	    pHot->nAlloc = pHot->nAlloc * 2 + 64;
+	}
+    }
+    /* Out of memory only makes the hot set smaller. */
+    if (pHot->nOrder < pHot->nAlloc)
+	pHot->aOrder[pHot->nOrder++] = iChunk;
+    pthread_mutex_unlock(&pHot->mutex);
+}
+
+/*
+** Prefetch the recorded chunks still in the region, taking them in order
+** with the other warm threads.
+*/
+static void *auroraHotWarmThread(void *pArg){
+    AuroraHot *pHot = (AuroraHot *)pArg;
+    sqlite3_int64 szPage = sysconf(_SC_PAGESIZE);
+    uintptr_t iStart, iEnd;
+    sqlite3_int64 i, iOfst, nByte;
+
+    while (!__atomic_load_n(&pHot->bStop, __ATOMIC_RELAXED)) {
+	i = __atomic_fetch_add(&pHot->iWarmNext, 1, __ATOMIC_RELAXED);
+	if (i >= pHot->nWarm)
+	    break;
+
+	iOfst = (sqlite3_int64)pHot->aWarm[i] * AURORA_HOT_CHUNK;
+	if (iOfst < pHot->szWarm) {
+	    nByte = pHot->szWarm - iOfst;
+	    if (nByte > AURORA_HOT_CHUNK)
+		nByte = AURORA_HOT_CHUNK;
+	    iStart = (uintptr_t)(pHot->aData + iOfst) & ~(uintptr_t)(szPage - 1);
+	    iEnd = ((uintptr_t)(pHot->aData + iOfst + nByte) + szPage - 1) &
+		~(uintptr_t)(szPage - 1);
+	    auroraPopulate((unsigned char *)iStart, iEnd - iStart);
+	}
+	__atomic_fetch_add(&pHot->nWarmDone, 1, __ATOMIC_RELAXED);
+    }
+
+    return NULL;
+}
+
+/*
+** Read the hot set the file recorded last time into aWarm. A missing or
+** unusable file leaves nothing to warm.
+*/
+static void auroraHotLoad(AuroraHot *pHot){
+    uint32_t aHdr[3];
+    sqlite3_int64 nByte;
+    int fd;
+
+    fd = open(pHot->zPath, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+	return;
+
+    if (pread(fd, aHdr, sizeof(aHdr), 0) == sizeof(aHdr) &&
+	aHdr[0] == AURORA_HOT_MAGIC && aHdr[1] == AURORA_HOT_CHUNK &&
+	aHdr[2] > 0 && aHdr[2] <= pHot->nChunk) {
+	nByte = (sqlite3_int64)aHdr[2] * sizeof(uint32_t);
+	pHot->aWarm = sqlite3_malloc64(nByte);
+	if (pHot->aWarm != NULL &&
+	    pread(fd, pHot->aWarm, nByte, sizeof(aHdr)) == nByte) {
+	    pHot->nWarm = aHdr[2];
+	} else {
+	    sqlite3_free(pHot->aWarm);
+	    pHot->aWarm = NULL;
+	}
+    }
+
+    close(fd);
+}
+
+/*
+** Write the hot set recorded by this file over zPath, through a rename so
+** that a reader never sees half of it.
+*/
+static void auroraHotSave(AuroraHot *pHot){
+    uint32_t aHdr[3];
+    sqlite3_int64 nByte;
+    char *zTmp;
+    int fd;
+    bool bOk;
+
+    zTmp = sqlite3_mprintf("%s-tmp", pHot->zPath);
+    if (zTmp == NULL)
+	return;
+
+    fd = open(zTmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+	sqlite3_free(zTmp);
+	return;
+    }
+
+    aHdr[0] = AURORA_HOT_MAGIC;
+    aHdr[1] = AURORA_HOT_CHUNK;
+    aHdr[2] = pHot->nOrder;
+    nByte = pHot->nOrder * sizeof(uint32_t);
+    bOk = write(fd, aHdr, sizeof(aHdr)) == sizeof(aHdr) &&
+	write(fd, pHot->aOrder, nByte) == nByte;
+    close(fd);
+
+    if (!bOk || rename(zTmp, pHot->zPath) != 0)
+	unlink(zTmp);
+    sqlite3_free(zTmp);
+}
+
+/*
+** Start recording the hot set of the file into zPath, and warming the
+** region from what it recorded before with nThread threads.
+*/
+static int auroraHotStart(AuroraFile *p, const char *zPath, int nSample,
+    int nThread){
+    AuroraHot *pHot;
+    sqlite3_int64 nWord;
+    int i;
+
+    pHot = sqlite3_malloc(sizeof(*pHot));
+    if (pHot == NULL)
+	return SQLITE_NOMEM;
+    memset(pHot, 0, sizeof(*pHot));
+    pHot->nSample = nSample;
+    pHot->nChunk = (p->szMax + AURORA_HOT_CHUNK - 1) / AURORA_HOT_CHUNK;
+    pHot->aData = p->aData;
+    pHot->szWarm = p->sz;
+    nWord = (pHot->nChunk + 63) / 64;
+    pHot->zPath = sqlite3_mprintf("%s", zPath);
+    pHot->aSeen = sqlite3_malloc64(nWord * sizeof(sqlite3_uint64));
+    pHot->aThread = sqlite3_malloc64(nThread * sizeof(pthread_t));
+    if (pHot->zPath == NULL || pHot->aSeen == NULL ||
+	(nThread > 0 && pHot->aThread == NULL)) {
+	sqlite3_free(pHot->zPath);
+	sqlite3_free(pHot->aSeen);
+	sqlite3_free(pHot->aThread);
+	sqlite3_free(pHot);
+	return SQLITE_NOMEM;
+    }
+    memset(pHot->aSeen, 0, nWord * sizeof(sqlite3_uint64));
+    pthread_mutex_init(&pHot->mutex, NULL);
+
+    auroraHotLoad(pHot);
+    for (i = 0; i < nThread && pHot->nWarm > 0; i++) {
+	if (pthread_create(&pHot->aThread[i], NULL, auroraHotWarmThread, pHot) != 0)
+	    break;
+	pHot->nThread++;
+    }
+
+    p->pHot = pHot;
+
+    return SQLITE_OK;
+}
+
 /*
-** Methods for AuroraFile
+** Stop warming the region, save the hot set if anything was recorded and
+** release it.
 */
-static int auroraClose(sqlite3_file*);
-static int auroraRead(sqlite3_file*, void*, int iAmt, sqlite3_int64 iOfst);
-static int auroraWrite(sqlite3_file*,const void*,int iAmt, sqlite3_int64 iOfst);
-static int auroraTruncate(sqlite3_file*, sqlite3_int64 size);
-static int auroraSync(sqlite3_file*, int flags);
-static int auroraFileSize(sqlite3_file*, sqlite3_int64 *pSize);
-static int auroraLock(sqlite3_file*, int);
-static int auroraUnlock(sqlite3_file*, int);
-static int auroraCheckReservedLock(sqlite3_file*, int *pResOut);
-static int auroraFileControl(sqlite3_file*, int op, void *pArg);
-static int auroraSectorSize(sqlite3_file*);
-static int auroraDeviceCharacteristics(sqlite3_file*);
-static int auroraShmMap(sqlite3_file*, int iPg, int pgsz, int, void volatile**);
-static int auroraShmLock(sqlite3_file*, int offset, int n, int flags);
-static void auroraShmBarrier(sqlite3_file*);
-static int auroraShmUnmap(sqlite3_file*, int deleteFlag);
-static int auroraFetch(sqlite3_file*, sqlite3_int64 iOfst, int iAmt, void **pp);
-static int auroraUnfetch(sqlite3_file*, sqlite3_int64 iOfst, void *p);
+static void auroraHotFree(AuroraFile *p){
+    AuroraHot *pHot = p->pHot;
+    int i;
+
+    __atomic_store_n(&pHot->bStop, true, __ATOMIC_RELAXED);
+    for (i = 0; i < pHot->nThread; i++)
+	pthread_join(pHot->aThread[i], NULL);
+
+    if (pHot->nOrder > 0)
+	auroraHotSave(pHot);
+
+    pthread_mutex_destroy(&pHot->mutex);
+    sqlite3_free(pHot->zPath);
+    sqlite3_free(pHot->aSeen);
+    sqlite3_free(pHot->aOrder);
+    sqlite3_free(pHot->aWarm);
+    sqlite3_free(pHot->aThread);
+    sqlite3_free(pHot);
+    p->pHot = NULL;
+}
 
 /*
-** Methods for AuroraVfs
+** Release the checkpointing state of an aurora-file.
 */
-static int auroraOpen(sqlite3_vfs*, const char *, sqlite3_file*, int , int *);
-static int auroraDelete(sqlite3_vfs*, const char *zName, int syncDir);
-static int auroraAccess(sqlite3_vfs*, const char *zName, int flags, int *);
-static int auroraFullPathname(sqlite3_vfs*, const char *zName, int, char *zOut);
-static void *auroraDlOpen(sqlite3_vfs*, const char *zFilename);
-static void auroraDlError(sqlite3_vfs*, int nByte, char *zErrMsg);
-static void (*auroraDlSym(sqlite3_vfs *pVfs, void *p, const char*zSym))(void);
-static void auroraDlClose(sqlite3_vfs*, void*);
-static int auroraRandomness(sqlite3_vfs*, int nByte, char *zOut);
-static int auroraSleep(sqlite3_vfs*, int microseconds);
-static int auroraCurrentTime(sqlite3_vfs*, double*);
-static int auroraGetLastError(sqlite3_vfs*, int, char *);
-static int auroraCurrentTimeInt64(sqlite3_vfs*, sqlite3_int64*);
+static void auroraCkptFree(AuroraFile *p){
+    auroraDurableNotify(p, true);
 
-static sqlite3_vfs aurora_vfs = {
-        2,                           /* iVersion */
-        0,                           /* szOsFile (set when registered) */
-        1024,                        /* mxPathname */
-        0,                           /* pNext */
-        "auroravfs",                    /* zName */
-        0,                           /* pAppData (set when registered) */
-        auroraOpen,                     /* xOpen */
-        auroraDelete,                   /* xDelete */
-        auroraAccess,                   /* xAccess */
-        auroraFullPathname,             /* xFullPathname */
-        auroraDlOpen,                   /* xDlOpen */
-        auroraDlError,                  /* xDlError */
-        auroraDlSym,                    /* xDlSym */
-        auroraDlClose,                  /* xDlClose */
-        auroraRandomness,               /* xRandomness */
-        auroraSleep,                    /* xSleep */
-        auroraCurrentTime,              /* xCurrentTime */
-        auroraGetLastError,             /* xGetLastError */
-        auroraCurrentTimeInt64          /* xCurrentTimeInt64 */
-};
+    if (p->pHot != NULL)
+	auroraHotFree(p);
 
-static const sqlite3_io_methods aurora_io_methods = {
-        3,                              /* iVersion */
-        auroraClose,                      /* xClose */
-        auroraRead,                       /* xRead */
-        auroraWrite,                      /* xWrite */
-        auroraTruncate,                   /* xTruncate */
-        auroraSync,                       /* xSync */
-        auroraFileSize,                   /* xFileSize */
-        auroraLock,                       /* xLock */
-        auroraUnlock,                     /* xUnlock */
-        auroraCheckReservedLock,          /* xCheckReservedLock */
-        auroraFileControl,                /* xFileControl */
-        auroraSectorSize,                 /* xSectorSize */
-        auroraDeviceCharacteristics,      /* xDeviceCharacteristics */
-        auroraShmMap,                     /* xShmMap */
-        auroraShmLock,                    /* xShmLock */
-        auroraShmBarrier,                 /* xShmBarrier */
-        auroraShmUnmap,                   /* xShmUnmap */
-        auroraFetch,                      /* xFetch */
-        auroraUnfetch                     /* xUnfetch */
-};
+#ifdef AURORA_HAVE_UFFD
+    /* Nobody may fault on the region without the thread serving them. */
+    if (p->pRestore != NULL)
+	auroraRestoreFree(p);
+#endif
+
+    if (p->pRegion != NULL)
+	auroraRegionLeave(p);
+
+    if (p->pCkptGroup != NULL)
+	auroraCkptGroupLeave(p);
+
+    if (p->nFlushThread > 1)
+	auroraFlushPoolRelease();
+    p->nFlushThread = 0;
+
+    if (p->pBackend != NULL)
+	p->pBackend->xClose(p);
+    p->pBackend = NULL;
+    sqlite3_free(p->zImage);
+    p->zImage = NULL;
+
+    auroraPolicyFree(p->pPolicy);
+    p->pPolicy = NULL;
+
+    if (p->pGroup != NULL)
+	auroraGroupRelease(p->pGroup);
+
+    if (p->pTenant != NULL)
+	auroraTenantRelease(p->pTenant);
+    p->pTenant = NULL;
 
+    auroraShadowFree(p);
+    auroraBaseReset(p);
+    sqlite3_free(p->apBase);
+    p->apBase = NULL;
+    auroraDirtyFree(p);
+
+    pthread_mutex_destroy(&p->bucket.mutex);
+    pthread_cond_destroy(&p->ckptDone);
+    pthread_cond_destroy(&p->ckptWork);
+    pthread_mutex_destroy(&p->ckptMutex);
+}
 
 /*
 ** Close an aurora-file.
@@ -163,9 +5141,90 @@ static const sqlite3_io_methods aurora_io_methods = {
 */
 static int auroraClose(sqlite3_file *pFile){
     AuroraFile *p = (AuroraFile *)pFile;
+    int rc = SQLITE_OK;
+
     if (!p->isAurMmap)
 	    return p->pReal->pMethods->xClose(p->pReal);
 
+    if (p->eCkptMode == AURORA_CKPT_ASYNC)
+	rc = auroraCkptThreadStop(p);
+
+    auroraCkptFree(p);
+
+    /* The underlying file holds the wal-index in WAL mode. */
+    if (p->pReal->pMethods != NULL)
+	p->pReal->pMethods->xClose(p->pReal);
+
+    return rc;
+}
+
+/*
+** End a full overwrite of an aurora-file, if one is in progress. Pages
+** were not tracked while it lasted, so the whole image is dirty now.
+** Returns true if anything was written, which calls for a checkpoint.
+** In async mode the caller must hold ckptMutex.
+*/
+static bool auroraOverwriteEnd(AuroraFile *p){
+    if (!p->bOverwrite)
+	return false;
+
+    p->bOverwrite = false;
+    auroraDirtyMark(p, 0, p->sz);
+    if (p->szWritten > 0)
+	p->bCkptPending = true;
+
+    return p->szWritten > 0;
+}
+
+/*
+** Copy nByte bytes from z to offset iOfst of the region. Unless skipSame=0,
+** parts that already hold the same bytes are skipped, page by page with
+** dirty tracking, so they do not become dirty. Sets *pnChanged to the
+** number of bytes actually written.
+*/
+static int auroraCopyIn(
+        AuroraFile *p,
+        const unsigned char *z,
+        sqlite3_int64 nByte,
+        sqlite3_int64 iOfst,
+        sqlite3_int64 *pnChanged
+){
+    sqlite3_int64 iEnd = iOfst + nByte;
+    sqlite3_int64 iCut, n;
+    int rc;
+
+    /* A full overwrite changes about everything, and is not tracked. */
+    if (p->bOverwrite) {
+	rc = auroraCowPreserve(p, iOfst, nByte);
+	if (rc != SQLITE_OK)
+	    return rc;
+
+	memcpy(p->aData + iOfst, z, nByte);
+	*pnChanged = nByte;
+	return SQLITE_OK;
+    }
+
+    *pnChanged = 0;
+    while (iOfst < iEnd) {
+	iCut = iEnd;
+	if (p->szDirtyPg != 0 && ((iOfst >> p->nDirtyShift) + 1) << p->nDirtyShift < iEnd)
+	    iCut = ((iOfst >> p->nDirtyShift) + 1) << p->nDirtyShift;
+	n = iCut - iOfst;
+
+	if (!p->bSkipSame || iCut > p->sz || memcmp(p->aData + iOfst, z, n) != 0) {
+	    rc = auroraCowPreserve(p, iOfst, n);
+	    if (rc != SQLITE_OK)
+		return rc;
+
+	    memcpy(p->aData + iOfst, z, n);
+	    auroraDirtyMark(p, iOfst, n);
+	    *pnChanged += n;
+	}
+
+	z += n;
+	iOfst = iCut;
+    }
+
     return SQLITE_OK;
 }
 
@@ -182,6 +5241,8 @@ static int auroraRead(
     if (!p->isAurMmap)
         return p->pReal->pMethods->xRead(p->pReal, zBuf, iAmt, iOfst);
 
+    if (p->pHot != NULL)
+	auroraHotRecord(p->pHot, iOfst);
     memcpy(zBuf, p->aData + iOfst, iAmt);
     return SQLITE_OK;
 }
@@ -196,6 +5257,8 @@ static int auroraWrite(
         sqlite_int64 iOfst
 ){
     const size_t szEnd = iOfst + iAmt;
+    sqlite3_int64 szUndurable = 0;
+    sqlite3_int64 nChanged;
     int rc;
 
     AuroraFile *p = (AuroraFile *)pFile;
@@ -205,27 +5268,32 @@ static int auroraWrite(
     if (szEnd > p->szMax)
     	return SQLITE_FULL;
 
-    /* Copy in the data and possibly adjust the file size. */
-    p->sz = szEnd > p->sz ? szEnd : p->sz;
-    memcpy(p->aData + iOfst, z, iAmt);
-
-    /* Check if we went over the checkpointing threshold. */
-    p->szWritten += iAmt;
-
-    /* A 0 threshold turns off xWrite() checkpointing. */
-    if (p->szThreshold == 0)
-	    return SQLITE_OK;
+    /* Not every write comes with a RESERVED lock, e.g. WAL checkpoints. */
+    auroraRegionWriteBegin(p);
 
-    if (p->szWritten > p->szThreshold) {
-	
-	rc = sas_trace_commit(p->fd);
-	if (rc < 0)
-		return SQLITE_ERROR_SNAPSHOT;
+    /*
+     * Copy in what changed and possibly adjust the file size. In async
+     * mode this must not race with the checkpointer freezing the dirty
+     * set, and pages it has yet to persist may need to be saved first.
+     */
+    auroraCkptLock(p);
+    rc = auroraCopyIn(p, z, iAmt, iOfst, &nChanged);
+    if (rc == SQLITE_OK) {
+	p->sz = szEnd > p->sz ? szEnd : p->sz;
+	p->szUndurable += nChanged;
+	szUndurable = p->szUndurable;
 
-	p->szWritten = 0;
+	/* Let the policy know, it may ask for a checkpoint at commit. */
+	if (nChanged > 0)
+	    auroraPolicyEvent(p, AURORA_EV_WRITE, nChanged);
     }
+    auroraCkptUnlock(p);
 
-    return SQLITE_OK;
+    /* Push back if the checkpointer cannot keep up. */
+    if (rc == SQLITE_OK && !p->bOverwrite)
+	auroraThrottle(p, szUndurable);
+
+    return rc;
 }
 
 /*
@@ -233,40 +5301,57 @@ static int auroraWrite(
 */
 static int auroraTruncate(sqlite3_file *pFile, sqlite_int64 size){
     AuroraFile *p = (AuroraFile *)pFile;
+    int rc = SQLITE_OK;
+
     if (!p->isAurMmap)
         return p->pReal->pMethods->xTruncate(p->pReal, size);
 
-    if (size > p->sz) {
-    	if (size > p->szMax)
-		return SQLITE_FULL;
+    if (size > p->szMax)
+	return SQLITE_FULL;
+
+    auroraRegionWriteBegin(p);
+    auroraCkptLock(p);
 
-    	memset(p->aData+p->sz, 0, size-p->sz);
+    if (size > p->sz) {
+	rc = auroraCowPreserve(p, p->sz, size - p->sz);
+	if (rc == SQLITE_OK) {
+	    memset(p->aData+p->sz, 0, size-p->sz);
+	    auroraDirtyMark(p, p->sz, size - p->sz);
+	}
     }
 
-    p->sz = size;
-    return SQLITE_OK;
+    if (rc == SQLITE_OK)
+	p->sz = size;
+
+    auroraCkptUnlock(p);
+
+    return rc;
 }
 
 /*
 ** Sync an aurora-file.
 */
 static int auroraSync(sqlite3_file *pFile, int flags){
-    int rc;
-
     AuroraFile *p = (AuroraFile *)pFile;
+    bool bDue, bWriter;
+    int rc = SQLITE_OK;
+
     if (!p->isAurMmap)
         return p->pReal->pMethods->xSync(p->pReal, flags);
 
-    if (!p->bCkptOnSync || p->szWritten == 0)
-	    return SQLITE_OK;
+    auroraCkptLock(p);
+    bDue = auroraOverwriteEnd(p) || auroraPolicyEvent(p, AURORA_EV_SYNC, 0);
+    bWriter = p->eLock >= SQLITE_LOCK_RESERVED || p->bWalCkpt;
+    auroraCkptUnlock(p);
 
-    rc = sas_trace_commit(p->fd);
-    if (rc < 0)
-	return SQLITE_ERROR_SNAPSHOT;
+    if (bDue)
+	rc = auroraCheckpoint(p);
 
-    p->szWritten = 0;
+    /* Writes outside of a transaction or WAL checkpoint end here. */
+    if (!bWriter)
+	auroraRegionWriteEnd(p);
 
-    return SQLITE_OK;
+    return rc;
 }
 
 /*
@@ -286,8 +5371,22 @@ static int auroraFileSize(sqlite3_file *pFile, sqlite_int64 *pSize){
 */
 static int auroraLock(sqlite3_file *pFile, int eLock){
     AuroraFile *p = (AuroraFile *)pFile;
-    if (!p->isAurMmap)
+    if (!p->isAurMmap) {
         p->pReal->pMethods->xLock(p->pReal, eLock);
+	return SQLITE_OK;
+    }
+
+    /* New write transactions wait while the region is frozen. */
+    if (eLock >= SQLITE_LOCK_RESERVED)
+	auroraRegionWriteBegin(p);
+
+    /* Time-based checkpoints must know if a transaction is running. */
+    auroraCkptLock(p);
+    p->eLock = eLock;
+    auroraCkptUnlock(p);
+
+    if (p->pCkptGroup != NULL)
+	return auroraCkptGroupLock(p, eLock);
     
     return SQLITE_OK;
 }
@@ -297,8 +5396,26 @@ static int auroraLock(sqlite3_file *pFile, int eLock){
 */
 static int auroraUnlock(sqlite3_file *pFile, int eLock){
     AuroraFile *p = (AuroraFile *)pFile;
-    if (!p->isAurMmap)
+    bool bWalCkpt;
+    if (!p->isAurMmap) {
 	p->pReal->pMethods->xUnlock(p->pReal, eLock);
+	return SQLITE_OK;
+    }
+
+    /* An overwrite that ends without commit is left to the next one. */
+    auroraCkptLock(p);
+    p->eLock = eLock;
+    if (eLock < SQLITE_LOCK_RESERVED)
+	auroraOverwriteEnd(p);
+    bWalCkpt = p->bWalCkpt;
+    auroraCkptUnlock(p);
+
+    if (eLock < SQLITE_LOCK_RESERVED && !bWalCkpt)
+	auroraRegionWriteEnd(p);
+
+    /* The last transaction of a group to end takes its checkpoint. */
+    if (p->pCkptGroup != NULL)
+	return auroraCkptGroupLock(p, eLock);
 	
     return SQLITE_OK;
 }
@@ -320,15 +5437,153 @@ static int auroraCheckReservedLock(sqlite3_file *pFile, int *pResOut){
 */
 static int auroraFileControl(sqlite3_file *pFile, int op, void *pArg){
     AuroraFile *p = (AuroraFile *)pFile;
+    bool bDue, bWriter;
     int rc;
 
     if (!p->isAurMmap)
         return p->pReal->pMethods->xFileControl(p->pReal, op, pArg);
 
     rc = SQLITE_NOTFOUND;
-    if (op == SQLITE_FCNTL_VFSNAME) {
+    switch (op) {
+    case SQLITE_FCNTL_VFSNAME:
         *(char**)pArg = sqlite3_mprintf("aurora(%p,%lld)", p->aData, p->sz);
         rc = SQLITE_OK;
+        break;
+
+    case SQLITE_FCNTL_SYNC:
+	/*
+	 * All pages of the transaction are in place. Take a pending
+	 * checkpoint now, unless the xSync() that follows is going to
+	 * take one anyway.
+	 */
+	auroraCkptLock(p);
+	bDue = auroraOverwriteEnd(p) || (p->bCkptPending &&
+	    p->szWritten > 0 && !auroraPolicyEvent(p, AURORA_EV_SYNC, 0));
+	auroraCkptUnlock(p);
+
+	rc = bDue ? auroraCheckpoint(p) : SQLITE_OK;
+	break;
+
+    case SQLITE_FCNTL_COMMIT_PHASETWO:
+	/*
+	 * The transaction is complete. This is where commit-based
+	 * policies are evaluated, and where we catch pending
+	 * checkpoints that neither SQLITE_FCNTL_SYNC nor xSync() took,
+	 * e.g. because xSync() was skipped with synchronous=OFF.
+	 */
+	auroraCkptLock(p);
+	auroraOverwriteEnd(p);
+	bDue = auroraPolicyEvent(p, AURORA_EV_COMMIT, 0);
+	auroraCkptUnlock(p);
+
+	rc = bDue ? auroraCheckpoint(p) : SQLITE_OK;
+	break;
+
+    case SQLITE_FCNTL_OVERWRITE:
+	/*
+	 * VACUUM is about to rewrite the whole file. Stop tracking pages
+	 * and holding checkpoints against the policy until the end of the
+	 * transaction, which then checkpoints the full image once.
+	 */
+	auroraCkptLock(p);
+	p->bOverwrite = true;
+	auroraCkptUnlock(p);
+	rc = SQLITE_OK;
+	break;
+
+#if defined(SQLITE_FCNTL_CKPT_START) && defined(SQLITE_FCNTL_CKPT_DONE)
+    case SQLITE_FCNTL_CKPT_START:
+	/*
+	 * In WAL mode the database only changes when SQLite copies the
+	 * WAL back into it. Hold all checkpoints while it does so, and
+	 * take a single one once it is done. It does so without a
+	 * RESERVED lock, so it has to wait for freezes by itself.
+	 */
+	auroraRegionWriteBegin(p);
+	auroraCkptLock(p);
+	p->bWalCkpt = true;
+	auroraCkptUnlock(p);
+	rc = SQLITE_OK;
+	break;
+
+    case SQLITE_FCNTL_CKPT_DONE:
+	auroraCkptLock(p);
+	p->bWalCkpt = false;
+	bDue = p->szWritten > 0;
+	bWriter = p->eLock >= SQLITE_LOCK_RESERVED;
+	auroraCkptUnlock(p);
+
+	rc = bDue ? auroraCheckpoint(p) : SQLITE_OK;
+	if (!bWriter)
+	    auroraRegionWriteEnd(p);
+	break;
+#endif
+
+    case AURORA_FCNTL_EPOCHS:
+	((AuroraEpochs *)pArg)->iWritten = auroraEpochWritten(p);
+	pthread_mutex_lock(&p->ckptMutex);
+	((AuroraEpochs *)pArg)->iDurable = p->iEpochDone;
+	pthread_mutex_unlock(&p->ckptMutex);
+	rc = SQLITE_OK;
+	break;
+
+    case AURORA_FCNTL_WAIT_DURABLE:
+	rc = auroraWaitDurable(p, *(sqlite3_uint64 *)pArg);
+	break;
+
+    case AURORA_FCNTL_ON_DURABLE:
+	rc = auroraOnDurable(p, (AuroraDurableCallback *)pArg);
+	break;
+
+    case AURORA_FCNTL_ADAPTIVE:
+	if (p->adapt.szThreshold == 0)
+	    break;
+
+	auroraCkptLock(p);
+	((AuroraAdaptiveStats *)pArg)->szThreshold = p->adapt.szThreshold;
+	((AuroraAdaptiveStats *)pArg)->nLastCkptUs = p->adapt.nLastUs;
+	((AuroraAdaptiveStats *)pArg)->nP99CkptUs = p->adapt.nP99Us;
+	((AuroraAdaptiveStats *)pArg)->nWriteRate = p->adapt.nWriteRate;
+	((AuroraAdaptiveStats *)pArg)->nTargetCkptUs = p->adapt.nTargetUs;
+	((AuroraAdaptiveStats *)pArg)->szTargetRpo = p->adapt.szTargetRpo;
+	auroraCkptUnlock(p);
+	rc = SQLITE_OK;
+	break;
+
+    case AURORA_FCNTL_SCHED:
+	pthread_mutex_lock(&auroraSched.mutex);
+	((AuroraSchedStats *)pArg)->nSlot = auroraSched.nSlot;
+	((AuroraSchedStats *)pArg)->nRunning = auroraSched.nRunning;
+	((AuroraSchedStats *)pArg)->nQueued = auroraSched.nQueued;
+	((AuroraSchedStats *)pArg)->nGranted = auroraSched.nGranted;
+	((AuroraSchedStats *)pArg)->nTotalWaitUs = auroraSched.nWaitUs;
+	((AuroraSchedStats *)pArg)->nMaxWaitUs = auroraSched.nMaxWaitUs;
+	((AuroraSchedStats *)pArg)->nLastWaitUs = p->nSchedWaitUs;
+	pthread_mutex_unlock(&auroraSched.mutex);
+	rc = SQLITE_OK;
+	break;
+
+    case AURORA_FCNTL_PREFAULT:
+	*(AuroraPrefaultStats *)pArg = p->prefault;
+	if (p->pHot != NULL) {
+	    AuroraPrefaultStats *pStats = (AuroraPrefaultStats *)pArg;
+
+	    pStats->nWarm = p->pHot->nWarm;
+	    pStats->nWarmDone = __atomic_load_n(&p->pHot->nWarmDone, __ATOMIC_RELAXED);
+	    pthread_mutex_lock(&p->pHot->mutex);
+	    pStats->nHot = p->pHot->nOrder;
+	    pthread_mutex_unlock(&p->pHot->mutex);
+	}
+	rc = SQLITE_OK;
+	break;
+
+    case AURORA_FCNTL_FREEZE:
+	rc = auroraFreeze(p, (AuroraFreeze *)pArg);
+	break;
+
+    case AURORA_FCNTL_THAW:
+	rc = auroraThaw(p);
+	break;
     }
 
     return rc;
@@ -368,47 +5623,33 @@ static int auroraShmMap(
         void volatile **pp
 ){
     AuroraFile *p = (AuroraFile *)pFile;
-    if (!p->isAurMmap)
-        return p->pReal->pMethods->xShmMap(p->pReal, iPg, pgsz, bExtend, pp);
 
-    /* 
-     * XXX Implement this; returning a pointer 
-     * into the mapped region should be fine.
+    /*
+     * The wal-index lives in the shared memory of the underlying file,
+     * not in the region, which only holds the database itself.
      */
-    return SQLITE_IOERR_SHMMAP;
+    return p->pReal->pMethods->xShmMap(p->pReal, iPg, pgsz, bExtend, pp);
 }
 
 /* Perform locking on a shared-memory segment */
 static int auroraShmLock(sqlite3_file *pFile, int offset, int n, int flags){
     AuroraFile *p = (AuroraFile *)pFile;
-    if (!p->isAurMmap)
-        return p->pReal->pMethods->xShmLock(p->pReal, offset, n, flags);
 
-    /* 
-     * XXX Implement this; using a no-op if fine right now 
-     * because we do not need to open the database from
-     * multiple processes.
-     */
-    return SQLITE_IOERR_SHMLOCK;
+    return p->pReal->pMethods->xShmLock(p->pReal, offset, n, flags);
 }
 
 /* Memory barrier operation on shared memory */
 static void auroraShmBarrier(sqlite3_file *pFile){
     AuroraFile *p = (AuroraFile *)pFile;
-    if (!p->isAurMmap)
-    	p->pReal->pMethods->xShmBarrier(p->pReal);
 
-    /* XXX Find a way to call this function. */
-    //sqlite3MemoryBarrier();
+    p->pReal->pMethods->xShmBarrier(p->pReal);
 }
 
 /* Unmap a shared memory segment */
 static int auroraShmUnmap(sqlite3_file *pFile, int deleteFlag){
     AuroraFile *p = (AuroraFile *)pFile;
-    if (!p->isAurMmap)
-        return p->pReal->pMethods->xShmUnmap(p->pReal, deleteFlag);
 
-    return SQLITE_OK;
+    return p->pReal->pMethods->xShmUnmap(p->pReal, deleteFlag);
 }
 
 /* Fetch a page of a memory-mapped file */
@@ -420,6 +5661,8 @@ static int auroraFetch(
 ){
     AuroraFile *p = (AuroraFile *)pFile;
     if (p->isAurMmap) {
+        if (p->pHot != NULL)
+            auroraHotRecord(p->pHot, iOfst);
         *pp = (void*)(p->aData + iOfst);
         return SQLITE_OK;
     } else {
@@ -449,6 +5692,8 @@ static int auroraOpen(
 ){
     AuroraFile *p = (AuroraFile*)pFile;
     memset(p, 0, sizeof(*p));
+    const char *zMode;
+    bool bCowable;
     int rc = SQLITE_OK;
 
     p->pReal = (sqlite3_file*)&p[1];
@@ -469,33 +5714,246 @@ static int auroraOpen(
 		return SQLITE_CANTOPEN;
 
         p->fd = sqlite3_uri_int64(zName, "fd", 0);
-        if (p->fd == 0)
+	p->fdImage = -1;
+	p->pBackend = auroraBackendFind(sqlite3_uri_parameter(zName, "backend"));
+	if (p->pBackend == NULL)
 		return SQLITE_CANTOPEN;
+	p->szForkMax = sqlite3_uri_int64(zName, "forkMax", 0);
+	p->bPmemDax = sqlite3_uri_boolean(zName, "pmemDax", 0);
+	p->szLogMax = sqlite3_uri_int64(zName, "logMax", 0);
 
-	if (sas_trace_start(p->fd) != 0)
-		return SQLITE_INTERNAL;
-	/* 
-	 * Threshold can be 0, in which case xWrite() 
-	 * does not trigger checkpointing at all.
+	/*
+	 * In async mode snapshots are taken by a background thread,
+	 * so xWrite()/xSync() only pay for them when they get too
+	 * far ahead of the checkpointer.
 	 */
-        p->szThreshold = sqlite3_uri_int64(zName, "threshold", 0);
+	p->eCkptMode = AURORA_CKPT_SYNC;
+	zMode = sqlite3_uri_parameter(zName, "ckptMode");
+	if (zMode != NULL && strcmp(zMode, "async") == 0)
+		p->eCkptMode = AURORA_CKPT_ASYNC;
+	else if (zMode != NULL && strcmp(zMode, "sync") != 0)
+		return SQLITE_CANTOPEN;
+
+        p->nMaxLag = sqlite3_uri_int64(zName, "maxLag", AURORA_DEFAULT_MAXLAG);
 
 	/*
-	 * Configure triggering checkpointing on xSync.
-	 * The default is to keep checkpointing on.
+	 * Connections on the same fd coalesce their snapshots if
+	 * a group commit window is configured.
 	 */
-        p->bCkptOnSync = sqlite3_uri_int64(zName, "ckptOnSync", 1) > 0;
+        p->nGroupCommitUs = sqlite3_uri_int64(zName, "groupCommitUs", 0);
+	if (p->nGroupCommitUs > 0) {
+		p->pGroup = auroraGroupAcquire(p->fd);
+		if (p->pGroup == NULL)
+			return SQLITE_NOMEM;
+	}
 
-        mainDbName = sqlite3_malloc(strlen(zName));
+	pthread_mutex_init(&p->ckptMutex, NULL);
+	pthread_cond_init(&p->ckptWork, NULL);
+	pthread_cond_init(&p->ckptDone, NULL);
+	auroraBucketInit(&p->bucket,
+	    sqlite3_uri_int64(zName, "ckptBandwidth", 0));
+	p->szHighWater = sqlite3_uri_int64(zName, "highWater", 0);
+
+        mainDbName = sqlite3_malloc(strlen(zName) + 1);
         strcpy(mainDbName, zName);
 
+	/* Where the file backends keep the image. */
+	{
+		const char *zImage = sqlite3_uri_parameter(zName, "backendPath");
+
+		if (zImage != NULL)
+			p->zImage = sqlite3_mprintf("%s", zImage);
+		else
+			p->zImage = sqlite3_mprintf("%s-img", zName);
+		if (p->zImage == NULL)
+			rc = SQLITE_NOMEM;
+	}
+	/* Only the file backends keep an image to restore from. */
+	zMode = sqlite3_uri_parameter(zName, "restore");
+	if (rc == SQLITE_OK && zMode != NULL) {
+		if (strcmp(p->pBackend->zName, "file") != 0 &&
+		    strcmp(p->pBackend->zName, "uring") != 0)
+			rc = SQLITE_CANTOPEN;
+		else
+			rc = auroraRestore(p, zMode);
+	}
+
+	if (rc == SQLITE_OK)
+		rc = p->pBackend->xStart(p);
+
+	/* Populate the region, now that it holds the database. */
+	if (rc == SQLITE_OK) {
+		int nThread = sqlite3_uri_int64(zName, "prefault", 0);
+
+		if (nThread < 0 || nThread > AURORA_MAX_PREFAULT_THREADS)
+			rc = SQLITE_CANTOPEN;
+		else if (nThread > 0)
+			rc = auroraPrefault(p, nThread,
+			    sqlite3_uri_boolean(zName, "mlock", 0));
+	}
+
+	/* Warm up the region from the hot set, and record the next one. */
+	if (rc == SQLITE_OK && sqlite3_uri_parameter(zName, "hotset") != NULL) {
+		int nSample = sqlite3_uri_int64(zName, "hotsetSample", 8);
+		int nThread = sqlite3_uri_int64(zName, "hotsetThreads", 2);
+
+		if (nSample < 1 || nThread < 0 ||
+		    nThread > AURORA_MAX_PREFAULT_THREADS)
+			rc = SQLITE_CANTOPEN;
+		else
+			rc = auroraHotStart(p,
+			    sqlite3_uri_parameter(zName, "hotset"),
+			    nSample, nThread);
+	}
+
+	/* Decide when to checkpoint. */
+	if (rc == SQLITE_OK)
+		rc = auroraPolicyInit(p, zName);
+
+	/* Track which pages change between checkpoints. */
+	if (rc == SQLITE_OK)
+		rc = auroraDirtyInit(p, sqlite3_uri_int64(zName, "dirtyPgsz",
+		    AURORA_DEFAULT_DIRTY_PGSZ));
+
+	/*
+	 * Copy-on-write only matters if writers can run during a
+	 * checkpoint, and works on the dirty set. It needs a backend
+	 * that persists the pages it is given: persistent memory can
+	 * only be flushed as it is now, the SLS snapshots the region
+	 * itself, and a forked child has a copy of its own.
+	 */
+	bCowable = p->szDirtyPg != 0 &&
+	    (p->pBackend->xWrite != NULL || p->pBackend->xAppend != NULL) &&
+	    p->pBackend != &auroraPmemBackend;
+	p->bCow = sqlite3_uri_boolean(zName, "cow",
+	    p->eCkptMode == AURORA_CKPT_ASYNC && bCowable);
+	if (rc == SQLITE_OK && p->bCow &&
+	    (p->eCkptMode != AURORA_CKPT_ASYNC || !bCowable))
+		rc = SQLITE_CANTOPEN;
+
+	/*
+	 * The checkpointer holds writers out until it can let them go
+	 * on, which without copy-on-write is after the commit, unless
+	 * a forked child writes the image. Refuse async mode where it
+	 * would only move the stall off the connection.
+	 */
+	if (rc == SQLITE_OK && p->eCkptMode == AURORA_CKPT_ASYNC &&
+	    !p->bCow && p->pBackend != &auroraForkBackend &&
+	    p->pBackend != &auroraNoneBackend)
+		rc = SQLITE_CANTOPEN;
+
+	/* In sync mode the connection would wait for the child anyway. */
+	if (rc == SQLITE_OK && p->pBackend == &auroraForkBackend &&
+	    p->eCkptMode != AURORA_CKPT_ASYNC)
+		rc = SQLITE_CANTOPEN;
+
+	/* Content hashes are per tracked page. */
+	p->bSkipSame = sqlite3_uri_boolean(zName, "skipSame", 1);
+	if (rc == SQLITE_OK && sqlite3_uri_boolean(zName, "pageHash", 0)) {
+		if (p->szDirtyPg == 0) {
+			rc = SQLITE_CANTOPEN;
+		} else {
+			p->aPageHash = sqlite3_malloc64(
+			    (p->nDirtyWord * 64) * sizeof(sqlite3_uint64));
+			if (p->aPageHash == NULL)
+				rc = SQLITE_NOMEM;
+			else
+				memset(p->aPageHash, 0,
+				    (p->nDirtyWord * 64) * sizeof(sqlite3_uint64));
+		}
+	}
+
+	/* Flush checkpoints with a pool of threads if asked to. */
+	if (rc == SQLITE_OK) {
+		int nThread = sqlite3_uri_int64(zName, "flushThreads", 1);
+		if (nThread < 1 || nThread > AURORA_MAX_FLUSH_THREADS)
+			rc = SQLITE_CANTOPEN;
+		else if (nThread > 1)
+			rc = auroraFlushPoolAcquire(nThread);
+		if (rc == SQLITE_OK)
+			p->nFlushThread = nThread;
+	}
+
+	if (p->bucket.nRate < 0 || p->szHighWater < 0)
+		rc = SQLITE_CANTOPEN;
+
+	/* Join the checkpoint scheduler. */
+	if (rc == SQLITE_OK) {
+		const char *zTenant = sqlite3_uri_parameter(zName, "tenant");
+		int nSlot = sqlite3_uri_int64(zName, "ckptSlots", -1);
+
+		p->nCkptPriority = sqlite3_uri_int64(zName, "ckptPriority", 1);
+		if (p->nCkptPriority < 1)
+			rc = SQLITE_CANTOPEN;
+		if (rc == SQLITE_OK) {
+			p->pTenant = auroraTenantAcquire(zTenant != NULL ? zTenant : "");
+			if (p->pTenant == NULL)
+				rc = SQLITE_NOMEM;
+		}
+		if (rc == SQLITE_OK && nSlot > 0)
+			auroraSchedSetSlots(nSlot);
+	}
+
+	/* Files of a group are persisted by one commit, inline. */
+	if (rc == SQLITE_OK && sqlite3_uri_parameter(zName, "group") != NULL) {
+		if (p->eCkptMode != AURORA_CKPT_SYNC ||
+		    strcmp(p->pBackend->zName, "sls") != 0)
+			rc = SQLITE_CANTOPEN;
+		else
+			rc = auroraCkptGroupJoin(p,
+			    sqlite3_uri_parameter(zName, "group"));
+	}
+
+	/* Make the file known to AURORA_FCNTL_FREEZE on the region. */
+	if (rc == SQLITE_OK)
+		rc = auroraRegionJoin(p);
+
+	/* Encoding only applies to backends that log page records. */
+	p->bDelta = sqlite3_uri_boolean(zName, "delta", 0);
+	p->bCompress = sqlite3_uri_boolean(zName, "compress", 0);
+	if (rc == SQLITE_OK && (p->bDelta || p->bCompress) &&
+	    p->pBackend->xAppend == NULL)
+		rc = SQLITE_CANTOPEN;
+	if (rc == SQLITE_OK && p->pBackend->xAppend != NULL &&
+	    p->szDirtyPg == 0)
+		rc = SQLITE_CANTOPEN;
+#ifndef AURORA_HAVE_ZSTD
+	if (rc == SQLITE_OK && p->bCompress)
+		rc = SQLITE_CANTOPEN;
+#endif
+	if (rc == SQLITE_OK && p->bDelta) {
+		p->apBase = sqlite3_malloc64(
+		    (p->nDirtyWord * 64) * sizeof(unsigned char *));
+		if (p->apBase == NULL)
+			rc = SQLITE_NOMEM;
+		else
+			memset(p->apBase, 0,
+			    (p->nDirtyWord * 64) * sizeof(unsigned char *));
+	}
+
         // Create the file, but don't do anything with it
-        rc = ORIGVFS(pVfs)->xOpen(ORIGVFS(pVfs), zName, p->pReal, flags, pOutFlags);
+        if (rc == SQLITE_OK)
+		rc = ORIGVFS(pVfs)->xOpen(ORIGVFS(pVfs), zName, p->pReal, flags, pOutFlags);
+        if (rc == SQLITE_OK && p->eCkptMode == AURORA_CKPT_ASYNC) {
+		rc = auroraCkptThreadStart(p);
+		if (rc != SQLITE_OK)
+			p->pReal->pMethods->xClose(p->pReal);
+	}
+
+	if (rc != SQLITE_OK)
+		auroraCkptFree(p);
     } else {
         rc = ORIGVFS(pVfs)->xOpen(ORIGVFS(pVfs), zName, p->pReal, flags, pOutFlags);
     }
-    p->fileName = sqlite3_malloc(strlen(zName));
-    strcpy(p->fileName, zName);
+    /*
+     * Temporary files, e.g. the one VACUUM builds into, have no name.
+     * xClose() is not called for files that failed to open.
+     */
+    if (rc == SQLITE_OK && zName != NULL) {
+        p->fileName = sqlite3_malloc(strlen(zName) + 1);
+        if (p->fileName != NULL)
+            strcpy(p->fileName, zName);
+    }
 
     if (rc == 0) {
         pFile->pMethods = &aurora_io_methods;
@@ -605,6 +6063,75 @@ static int auroraCurrentTimeInt64(sqlite3_vfs *pVfs, sqlite3_int64 *p){
     return ORIGVFS(pVfs)->xCurrentTimeInt64(ORIGVFS(pVfs), p);
 }
 
+/*
+** Implementation of aurora_freeze(MS [, SCHEMA]).
+*/
+static void auroraFreezeFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+    sqlite3 *db = sqlite3_context_db_handle(ctx);
+    const char *zSchema = "main";
+    AuroraFreeze freeze;
+    int rc;
+
+    if (argc > 1)
+	zSchema = (const char *)sqlite3_value_text(argv[1]);
+    memset(&freeze, 0, sizeof(freeze));
+    freeze.nMaxFreezeUs = sqlite3_value_int64(argv[0]) * 1000;
+
+    rc = sqlite3_file_control(db, zSchema, AURORA_FCNTL_FREEZE, &freeze);
+    if (rc != SQLITE_OK) {
+	sqlite3_result_error_code(ctx, rc);
+	return;
+    }
+
+    sqlite3_result_text(ctx, sqlite3_mprintf("ptr=%p&sz=%lld&epoch=%llu",
+	freeze.pData, freeze.sz, freeze.iEpoch), -1, sqlite3_free);
+}
+
+/*
+** Implementation of aurora_thaw([SCHEMA]).
+*/
+static void auroraThawFunc(sqlite3_context *ctx, int argc, sqlite3_value **argv){
+    sqlite3 *db = sqlite3_context_db_handle(ctx);
+    const char *zSchema = "main";
+    int rc;
+
+    if (argc > 0)
+	zSchema = (const char *)sqlite3_value_text(argv[0]);
+
+    rc = sqlite3_file_control(db, zSchema, AURORA_FCNTL_THAW, NULL);
+    if (rc != SQLITE_OK && rc != SQLITE_ABORT) {
+	sqlite3_result_error_code(ctx, rc);
+	return;
+    }
+
+    sqlite3_result_int(ctx, rc == SQLITE_OK);
+}
+
+/*
+** Register the SQL functions on a database connection.
+*/
+static int auroraRegisterFunctions(
+        sqlite3 *db,
+        char **pzErrMsg,
+        const sqlite3_api_routines *pApi
+){
+    int rc;
+
+    rc = sqlite3_create_function(db, "aurora_freeze", 1, SQLITE_UTF8, NULL,
+	auroraFreezeFunc, NULL, NULL);
+    if (rc == SQLITE_OK)
+	rc = sqlite3_create_function(db, "aurora_freeze", 2, SQLITE_UTF8, NULL,
+	    auroraFreezeFunc, NULL, NULL);
+    if (rc == SQLITE_OK)
+	rc = sqlite3_create_function(db, "aurora_thaw", 0, SQLITE_UTF8, NULL,
+	    auroraThawFunc, NULL, NULL);
+    if (rc == SQLITE_OK)
+	rc = sqlite3_create_function(db, "aurora_thaw", 1, SQLITE_UTF8, NULL,
+	    auroraThawFunc, NULL, NULL);
+
+    return rc;
+}
+
 /*
 ** This routine is called when the extension is loaded.
 ** Register the new VFS.
@@ -627,6 +6154,12 @@ int sqlite3_auroravfs_init(
     aurora_vfs.pAppData = pOrig;
     aurora_vfs.szOsFile = pOrig->szOsFile + sizeof(AuroraFile);
     rc = sqlite3_vfs_register(&aurora_vfs, 1);
+
+    /* Make the SQL functions available on every connection. */
+    if (rc == SQLITE_OK)
+	    rc = sqlite3_auto_extension((void (*)(void))auroraRegisterFunctions);
+    if (rc == SQLITE_OK && db != NULL)
+	    rc = auroraRegisterFunctions(db, pzErrMsg, pApi);
     if (rc == SQLITE_OK)
 	    rc = SQLITE_OK_LOAD_PERMANENTLY;
 
@@ -0,0 +1,143 @@
+/*
+ * Public interface of the aurora VFS.
+ */
+
+#ifndef _AURORAVFS_H_
+#define _AURORAVFS_H_
+
+#include "sqlite3.h"
+
+/*
+** Custom sqlite3_file_control() opcodes understood by aurora-files. They
+** are well clear of the SQLITE_FCNTL_* range used by SQLite itself.
+*/
+#define AURORA_FCNTL_BASE           0x41550000
+
+/*
+** Every checkpoint of an aurora-file closes an epoch. Writes go into the
+** open epoch, which becomes durable once the checkpoint that closed it
+** completes.
+**
+** AURORA_FCNTL_EPOCHS          pArg is an AuroraEpochs*, filled in with
+**                              the epoch holding the latest write and
+**                              the last durable epoch.
+**
+** AURORA_FCNTL_WAIT_DURABLE    pArg is a sqlite3_uint64* holding an epoch.
+**                              Blocks until it is durable, closing it
+**                              first if it is still open. In async mode
+**                              returns SQLITE_BUSY inside a write
+**                              transaction, which the checkpointer would
+**                              wait for.
+**
+** AURORA_FCNTL_ON_DURABLE      pArg is an AuroraDurableCallback*. Arranges
+**                              for xDurable to be called once the epoch is
+**                              durable, or a checkpoint failed, without
+**                              blocking the caller. The callback may run
+**                              on the checkpointer thread before or after
+**                              sqlite3_file_control() returns, and must
+**                              not call back into the database.
+*/
+#define AURORA_FCNTL_EPOCHS         (AURORA_FCNTL_BASE + 1)
+#define AURORA_FCNTL_WAIT_DURABLE   (AURORA_FCNTL_BASE + 2)
+#define AURORA_FCNTL_ON_DURABLE     (AURORA_FCNTL_BASE + 3)
+
+typedef struct AuroraEpochs AuroraEpochs;
+struct AuroraEpochs {
+    sqlite3_uint64 iWritten;        /* Epoch holding the latest write */
+    sqlite3_uint64 iDurable;        /* Last epoch persisted by a checkpoint */
+};
+
+typedef struct AuroraDurableCallback AuroraDurableCallback;
+struct AuroraDurableCallback {
+    sqlite3_uint64 iEpoch;          /* Epoch to wait for */
+    /* Called with the epoch and SQLITE_OK, or the checkpoint error. */
+    void (*xDurable)(void *pCtx, sqlite3_uint64 iEpoch, int rc);
+    void *pCtx;                     /* First argument to xDurable */
+};
+
+/*
+** AURORA_FCNTL_ADAPTIVE        pArg is an AuroraAdaptiveStats*, filled in
+**                              with the current decision and inputs of
+**                              the adaptive threshold controller. Returns
+**                              SQLITE_NOTFOUND if it is not enabled.
+*/
+#define AURORA_FCNTL_ADAPTIVE       (AURORA_FCNTL_BASE + 4)
+
+typedef struct AuroraAdaptiveStats AuroraAdaptiveStats;
+struct AuroraAdaptiveStats {
+    sqlite3_int64 szThreshold;      /* Current effective byte threshold */
+    sqlite3_int64 nLastCkptUs;      /* Duration of the last snapshot */
+    sqlite3_int64 nP99CkptUs;       /* p99 of recent snapshot durations */
+    sqlite3_int64 nWriteRate;       /* Recent write rate in bytes/s */
+    sqlite3_int64 nTargetCkptUs;    /* targetCkptUs=, 0 if unset */
+    sqlite3_int64 szTargetRpo;      /* targetRpo=, 0 if unset */
+};
+
+/*
+** AURORA_FCNTL_SCHED           pArg is an AuroraSchedStats*, filled in
+**                              with the state of the process-wide
+**                              checkpoint scheduler.
+*/
+#define AURORA_FCNTL_SCHED          (AURORA_FCNTL_BASE + 5)
+
+typedef struct AuroraSchedStats AuroraSchedStats;
+struct AuroraSchedStats {
+    sqlite3_int64 nSlot;            /* ckptSlots=, 0 for no limit */
+    sqlite3_int64 nRunning;         /* Checkpoints running */
+    sqlite3_int64 nQueued;          /* Checkpoints waiting for a slot */
+    sqlite3_int64 nGranted;         /* Checkpoints run so far */
+    sqlite3_int64 nTotalWaitUs;     /* Total time checkpoints waited */
+    sqlite3_int64 nMaxWaitUs;       /* Longest time a checkpoint waited */
+    sqlite3_int64 nLastWaitUs;      /* Wait of this file's last checkpoint */
+};
+
+/*
+** AURORA_FCNTL_FREEZE          pArg is an AuroraFreeze*. Quiesces the
+**                              region of the file for an external
+**                              snapshot: waits for running write
+**                              transactions and WAL checkpoints on it to
+**                              end, holds back new ones and any other
+**                              writes, and makes everything written so
+**                              far durable. On success pData and sz describe
+**                              a stable image of the database until the
+**                              region is thawed, or until nMaxFreezeUs
+**                              pass. Returns SQLITE_BUSY if the caller is
+**                              in a write transaction, the region is
+**                              already frozen, or it could not be frozen
+**                              in time.
+**
+** AURORA_FCNTL_THAW            pArg is unused. Lets writers resume.
+**                              Returns SQLITE_ABORT if the freeze had
+**                              already expired, in which case the image
+**                              may have changed under the snapshot.
+*/
+#define AURORA_FCNTL_FREEZE         (AURORA_FCNTL_BASE + 6)
+#define AURORA_FCNTL_THAW           (AURORA_FCNTL_BASE + 7)
+
+typedef struct AuroraFreeze AuroraFreeze;
+struct AuroraFreeze {
+    sqlite3_int64 nMaxFreezeUs;     /* In: thaw by itself after this long */
+    const void *pData;              /* Out: start of the database image */
+    sqlite3_int64 sz;               /* Out: size of the database image */
+    sqlite3_uint64 iEpoch;          /* Out: durable epoch of the image */
+};
+
+/*
+** AURORA_FCNTL_PREFAULT        pArg is an AuroraPrefaultStats*, filled in
+**                              with what prefault= did when the file was
+**                              opened, and how far hotset= got.
+*/
+#define AURORA_FCNTL_PREFAULT       (AURORA_FCNTL_BASE + 8)
+
+typedef struct AuroraPrefaultStats AuroraPrefaultStats;
+struct AuroraPrefaultStats {
+    sqlite3_int64 nThread;          /* Threads used, 0 if not prefaulted */
+    sqlite3_int64 szPrefault;       /* Bytes populated */
+    sqlite3_int64 nUs;              /* Time it took */
+    sqlite3_int64 bLocked;          /* Is the region mlock()ed? */
+    sqlite3_int64 nWarm;            /* Chunks in the hot set loaded */
+    sqlite3_int64 nWarmDone;        /* Of those, chunks prefetched */
+    sqlite3_int64 nHot;             /* Chunks recorded for the next open */
+};
+
+#endif /* _AURORAVFS_H_ */
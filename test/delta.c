@@ -0,0 +1,223 @@
+/*
+** Round trips of the page record encodings of delta= and compress=: a
+** page encoded against its previous image must decode back to itself,
+** and damaged records must be refused rather than applied.
+*/
+#include "../src/auroravfs.c"
+
+static int nFail = 0;
+
+#define check(x) do { \
+    if (!(x)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+	nFail++; \
+    } \
+} while (0)
+
+static sqlite3_uint64 iRand = 0x2545f4914f6cdd1dULL;
+
+static sqlite3_uint64 testRand(void){
+    iRand ^= iRand << 13;
+    iRand ^= iRand >> 7;
+    iRand ^= iRand << 17;
+    return iRand;
+}
+
+/* Ways of changing a page, from nothing to everything. */
+enum {
+    MUT_NONE, MUT_BYTE, MUT_FIRST, MUT_LAST, MUT_RUN, MUT_SPARSE, MUT_ALL,
+    MUT_COUNT
+};
+
+static void testMutate(unsigned char *a, int nByte, int eMut){
+    int i, iRun, nRun;
+
+    switch (eMut) {
+    case MUT_BYTE:
+	a[testRand() % nByte] ^= 0x5a;
+	break;
+    case MUT_FIRST:
+	a[0] ^= 1;
+	break;
+    case MUT_LAST:
+	a[nByte - 1] ^= 0x80;
+	break;
+    case MUT_RUN:
+	nRun = 1 + testRand() % (nByte / 4 + 1);
+	iRun = testRand() % (nByte - nRun + 1);
+	for (i = iRun; i < iRun + nRun; i++)
+	    a[i] = ~a[i];
+	break;
+    case MUT_SPARSE:
+	for (i = 0; i < nByte; i += 1 + testRand() % 64)
+	    a[i] ^= 1 + testRand() % 255;
+	break;
+    case MUT_ALL:
+	for (i = 0; i < nByte; i++)
+	    a[i] = ~a[i];
+	break;
+    }
+}
+
+static void testVarint(void){
+    static const sqlite3_uint64 aV[] = {
+	0, 1, 0x7f, 0x80, 0x3fff, 0x4000, 65536, 0xffffffffULL, ~0ULL,
+    };
+    unsigned char a[10];
+    sqlite3_uint64 v;
+    size_t i;
+    int n;
+
+    for (i = 0; i < sizeof(aV) / sizeof(aV[0]); i++) {
+	n = auroraPutVarint(a, aV[i]);
+	check(n >= 1 && n <= 10);
+	check(auroraGetVarint(a, n, &v) == n && v == aV[i]);
+	/* A varint cut short is not a smaller one. */
+	check(auroraGetVarint(a, n - 1, &v) == 0);
+    }
+}
+
+/*
+** Encode a mutated copy of a random page against the page, and check
+** that applying the delta to the page gives back the copy.
+*/
+static void testDelta(int nByte, int eMut){
+    unsigned char *aOld = malloc(nByte), *aNew = malloc(nByte);
+    unsigned char *aDelta = malloc(nByte), *aPage = malloc(nByte);
+    int i, nDelta, rc;
+
+    for (i = 0; i < nByte; i++)
+	aOld[i] = testRand() % 4 == 0 ? testRand() : 0;
+    memcpy(aNew, aOld, nByte);
+    testMutate(aNew, nByte, eMut);
+
+    nDelta = auroraDeltaEncode(aNew, aOld, nByte, aDelta);
+    check(nDelta < nByte);
+    if (eMut == MUT_NONE)
+	check(nDelta == 0);
+    if (eMut == MUT_ALL)
+	check(nDelta == -1);
+
+    if (nDelta >= 0) {
+	memcpy(aPage, aOld, nByte);
+	check(auroraDeltaApply(aPage, nByte, aDelta, nDelta) == SQLITE_OK);
+	check(memcmp(aPage, aNew, nByte) == 0);
+
+	/* Every literal run has a byte, so losing the last one is corrupt. */
+	if (nDelta > 0) {
+	    memcpy(aPage, aOld, nByte);
+	    check(auroraDeltaApply(aPage, nByte, aDelta, nDelta - 1) == SQLITE_CORRUPT);
+	}
+
+	/* A delta for a larger page must not be applied to a smaller one. */
+	if (eMut == MUT_LAST) {
+	    memcpy(aPage, aOld, nByte);
+	    check(auroraDeltaApply(aPage, nByte - 1, aDelta, nDelta) == SQLITE_CORRUPT);
+	}
+
+	/* However it is cut, it never writes past the page. */
+	for (i = 0; i < nDelta; i++) {
+	    memcpy(aPage, aOld, nByte);
+	    rc = auroraDeltaApply(aPage, nByte, aDelta, i);
+	    check(rc == SQLITE_OK || rc == SQLITE_CORRUPT);
+	}
+    }
+
+    free(aOld);
+    free(aNew);
+    free(aDelta);
+    free(aPage);
+}
+
+/*
+** Rebuild pages from records the way replay does, raw and as deltas,
+** compressed if built with zstd.
+*/
+static void testPageRec(int nByte){
+    unsigned char *aOld = malloc(nByte), *aNew = malloc(nByte);
+    unsigned char *aDelta = malloc(nByte), *aPage = malloc(nByte);
+    unsigned char *aTmp = malloc(nByte);
+    AuroraPageRec rec;
+    int i;
+
+    for (i = 0; i < nByte; i++)
+	aOld[i] = testRand();
+    memcpy(aNew, aOld, nByte);
+    testMutate(aNew, nByte, MUT_RUN);
+
+    memset(&rec, 0, sizeof(rec));
+    rec.nByte = nByte;
+    rec.eEnc = AURORA_ENC_RAW;
+    rec.nPayload = rec.nDelta = nByte;
+    memcpy(aPage, aOld, nByte);
+    check(auroraPageRecApply(&rec, aNew, aPage, aTmp) == SQLITE_OK);
+    check(memcmp(aPage, aNew, nByte) == 0);
+
+    /* A raw page of the wrong size is refused. */
+    rec.nPayload = rec.nDelta = nByte - 1;
+    check(auroraPageRecApply(&rec, aNew, aPage, aTmp) == SQLITE_CORRUPT);
+
+    rec.eEnc = AURORA_ENC_DELTA;
+    rec.nPayload = rec.nDelta = auroraDeltaEncode(aNew, aOld, nByte, aDelta);
+    check(rec.nDelta >= 0);
+    memcpy(aPage, aOld, nByte);
+    check(auroraPageRecApply(&rec, aDelta, aPage, aTmp) == SQLITE_OK);
+    check(memcmp(aPage, aNew, nByte) == 0);
+
+#ifdef AURORA_HAVE_ZSTD
+    {
+	size_t nZip = ZSTD_compressBound(nByte);
+	unsigned char *aZip = malloc(nZip);
+	size_t n;
+
+	n = ZSTD_compress(aZip, nZip, aDelta, rec.nDelta, AURORA_ZSTD_LEVEL);
+	check(!ZSTD_isError(n));
+	rec.eEnc = AURORA_ENC_DELTA | AURORA_ENC_ZSTD;
+	rec.nPayload = n;
+	memcpy(aPage, aOld, nByte);
+	check(auroraPageRecApply(&rec, aZip, aPage, aTmp) == SQLITE_OK);
+	check(memcmp(aPage, aNew, nByte) == 0);
+
+	/* Nor is a frame that does not decompress to nDelta bytes. */
+	rec.nDelta += 1;
+	check(auroraPageRecApply(&rec, aZip, aPage, aTmp) == SQLITE_CORRUPT);
+	rec.nDelta -= 1;
+	rec.nPayload = n - 1;
+	check(auroraPageRecApply(&rec, aZip, aPage, aTmp) == SQLITE_CORRUPT);
+	free(aZip);
+    }
+#else
+    /* Compressed records cannot be read without zstd. */
+    rec.eEnc = AURORA_ENC_DELTA | AURORA_ENC_ZSTD;
+    check(auroraPageRecApply(&rec, aDelta, aPage, aTmp) == SQLITE_CORRUPT);
+#endif
+
+    free(aOld);
+    free(aNew);
+    free(aDelta);
+    free(aPage);
+    free(aTmp);
+}
+
+int main(void){
+    static const int anByte[] = { 64, 100, 4096, 65536 };
+    size_t i;
+    int eMut, j;
+
+    testVarint();
+    for (i = 0; i < sizeof(anByte) / sizeof(anByte[0]); i++) {
+	for (eMut = 0; eMut < MUT_COUNT; eMut++) {
+	    for (j = 0; j < 20; j++)
+		testDelta(anByte[i], eMut);
+	}
+	testPageRec(anByte[i]);
+    }
+
+    if (nFail > 0) {
+	fprintf(stderr, "delta: %d checks failed\n", nFail);
+	return 1;
+    }
+    printf("delta: ok\n");
+
+    return 0;
+}
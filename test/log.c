@@ -0,0 +1,242 @@
+/*
+** Recovery from backend=log: a log replays into the database as of its
+** last complete checkpoint, whether it was cut short or damaged in the
+** middle of one, and compaction keeps it replayable.
+*/
+#include "../src/auroravfs.c"
+
+static int nFail = 0;
+
+#define check(x) do { \
+    if (!(x)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+	nFail++; \
+    } \
+} while (0)
+
+#define TEST_SZ (8 * 1024 * 1024)
+#define TEST_NTXN 40
+
+static char zDir[] = "/tmp/auroralogXXXXXX";
+static unsigned char *aRegion;
+
+static int testOpen(const char *zLog, const char *zOpts, sqlite3 **pDb){
+    char zUri[512];
+
+    memset(aRegion, 0, TEST_SZ);
+    snprintf(zUri, sizeof(zUri),
+	"file:%s/log.db?ptr=%p&sz=0&max=%d&backend=log&backendPath=%s&%s",
+	zDir, (void *)aRegion, TEST_SZ, zLog, zOpts);
+
+    return sqlite3_open_v2(zUri, pDb,
+	SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, "auroravfs");
+}
+
+static sqlite3_int64 testQuery(sqlite3 *db, const char *zSql){
+    sqlite3_stmt *pStmt;
+    sqlite3_int64 v = -1;
+
+    if (sqlite3_prepare_v2(db, zSql, -1, &pStmt, NULL) != SQLITE_OK)
+	return -1;
+    if (sqlite3_step(pStmt) == SQLITE_ROW)
+	v = sqlite3_column_int64(pStmt, 0);
+    sqlite3_finalize(pStmt);
+
+    return v;
+}
+
+static sqlite3_int64 testSize(const char *zPath){
+    struct stat st;
+
+    return stat(zPath, &st) == 0 ? st.st_size : -1;
+}
+
+static unsigned char *testRead(const char *zPath, sqlite3_int64 *pn){
+    unsigned char *a;
+    FILE *f;
+
+    *pn = testSize(zPath);
+    a = malloc(*pn);
+    f = fopen(zPath, "rb");
+    if (a == NULL || f == NULL || fread(a, 1, *pn, f) != (size_t)*pn)
+	*pn = -1;
+    if (f != NULL)
+	fclose(f);
+
+    return a;
+}
+
+static void testWrite(const char *zPath, const unsigned char *a, sqlite3_int64 n){
+    FILE *f = fopen(zPath, "wb");
+
+    check(f != NULL && fwrite(a, 1, n, f) == (size_t)n);
+    if (f != NULL)
+	fclose(f);
+}
+
+/*
+** Replay the first n bytes of aLog, with byte iFlip flipped unless it is
+** negative, and return the number of transactions that came back, or -1
+** if the result is not a sound database.
+*/
+static sqlite3_int64 testReplay(const char *zOpts, const unsigned char *aLog, sqlite3_int64 n, sqlite3_int64 iFlip){
+    char zLog[128];
+    unsigned char *a = malloc(n > 0 ? n : 1);
+    sqlite3_int64 nTxn = -1;
+    sqlite3 *db;
+
+    memcpy(a, aLog, n);
+    if (iFlip >= 0)
+	a[iFlip] ^= 0x01;
+    snprintf(zLog, sizeof(zLog), "%s/replay.log", zDir);
+    testWrite(zLog, a, n);
+    free(a);
+
+    if (testOpen(zLog, zOpts, &db) == SQLITE_OK) {
+	/* The database does not exist before the first checkpoint. */
+	if (testQuery(db, "SELECT count(*) FROM sqlite_schema") == 0)
+	    nTxn = 0;
+	else if (testQuery(db, "SELECT count(*) FROM pragma_integrity_check "
+		"WHERE integrity_check != 'ok'") == 0)
+	    nTxn = testQuery(db, "SELECT count(*) FROM t");
+    }
+    sqlite3_close(db);
+
+    return nTxn;
+}
+
+/*
+** Build a log of TEST_NTXN transactions, one checkpoint each, noting where
+** each of them ends, with logMax= high enough that it is never compacted.
+** Most of them change a few bytes of pages that were logged before, so
+** with delta= their records are deltas.
+*/
+static unsigned char *testBuild(const char *zOpts, sqlite3_int64 *aEnd, sqlite3_int64 *pn){
+    char zLog[128], zSql[256], zUri[256];
+    unsigned char *aLog;
+    sqlite3 *db;
+    int i;
+
+    snprintf(zLog, sizeof(zLog), "%s/build.log", zDir);
+    snprintf(zUri, sizeof(zUri), "%s&logMax=1073741824", zOpts);
+    unlink(zLog);
+    check(testOpen(zLog, zUri, &db) == SQLITE_OK);
+    check(sqlite3_exec(db, "PRAGMA journal_mode=MEMORY; "
+	"CREATE TABLE t(a INTEGER PRIMARY KEY, b BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+    aEnd[0] = testSize(zLog);
+
+    for (i = 1; i <= TEST_NTXN; i++) {
+	snprintf(zSql, sizeof(zSql),
+	    "BEGIN; INSERT INTO t VALUES(%d, randomblob(%d)); "
+	    "UPDATE t SET b = randomblob(8) || substr(b, 9) WHERE a = 1; COMMIT",
+	    i, i % 4 == 0 ? 3000 : 200);
+	check(sqlite3_exec(db, zSql, NULL, NULL, NULL) == SQLITE_OK);
+	aEnd[i] = testSize(zLog);
+	check(aEnd[i] > aEnd[i - 1]);
+    }
+    sqlite3_close(db);
+
+    aLog = testRead(zLog, pn);
+    check(*pn == aEnd[TEST_NTXN]);
+
+    return aLog;
+}
+
+static void testRecovery(const char *zOpts){
+    sqlite3_int64 aEnd[TEST_NTXN + 1], n, nRec = sizeof(AuroraLogRec);
+    unsigned char *aLog;
+    int i;
+
+    aLog = testBuild(zOpts, aEnd, &n);
+    if (n < 0)
+	return;
+
+    check(testReplay(zOpts, aLog, n, -1) == TEST_NTXN);
+
+    /* Cut anywhere in a checkpoint, only the ones before come back. */
+    for (i = 0; i < TEST_NTXN; i += 3) {
+	check(testReplay(zOpts, aLog, aEnd[i], -1) == i);
+	check(testReplay(zOpts, aLog, aEnd[i] + 1, -1) == i);
+	check(testReplay(zOpts, aLog, aEnd[i] + nRec, -1) == i);
+	check(testReplay(zOpts, aLog, aEnd[i] + nRec + 7, -1) == i);
+	check(testReplay(zOpts, aLog, aEnd[i + 1] - 1, -1) == i);
+    }
+
+    /*
+    ** A damaged byte in the records or the payload of a checkpoint fails
+    ** its hash, and hides it and all that follow.
+    */
+    for (i = 1; i <= TEST_NTXN; i += 7) {
+	check(testReplay(zOpts, aLog, n, aEnd[i - 1] + 2) == i - 1);
+	check(testReplay(zOpts, aLog, n, aEnd[i - 1] + nRec + 3) == i - 1);
+	check(testReplay(zOpts, aLog, n, aEnd[i] - nRec - 1) == i - 1);
+    }
+
+    /* So does one in the commit record itself. */
+    check(testReplay(zOpts, aLog, n, aEnd[TEST_NTXN] - nRec + 8) == TEST_NTXN - 1);
+
+    free(aLog);
+}
+
+/*
+** With logMax= the log is replaced by a snapshot once it grows past it,
+** and what replays from it is the latest state.
+*/
+static void testCompact(const char *zOpts){
+    char zLog[128], zSql[128], zUri[256];
+    sqlite3_int64 n, nMax = 0;
+    unsigned char *aLog;
+    sqlite3 *db;
+    int i;
+
+    snprintf(zLog, sizeof(zLog), "%s/compact.log", zDir);
+    snprintf(zUri, sizeof(zUri), "%s&logMax=262144", zOpts);
+    unlink(zLog);
+    check(testOpen(zLog, zUri, &db) == SQLITE_OK);
+    check(sqlite3_exec(db, "PRAGMA journal_mode=MEMORY; "
+	"CREATE TABLE t(a INTEGER PRIMARY KEY, b BLOB)", NULL, NULL, NULL) == SQLITE_OK);
+    for (i = 1; i <= 400; i++) {
+	snprintf(zSql, sizeof(zSql),
+	    "BEGIN; INSERT INTO t VALUES(%d, randomblob(1000)); "
+	    "DELETE FROM t WHERE a = %d; COMMIT", i, i - 100);
+	check(sqlite3_exec(db, zSql, NULL, NULL, NULL) == SQLITE_OK);
+	if (testSize(zLog) > nMax)
+	    nMax = testSize(zLog);
+    }
+    sqlite3_close(db);
+
+    /* 400 transactions of a page or more each would not fit otherwise. */
+    check(nMax < 2 * 262144);
+
+    aLog = testRead(zLog, &n);
+    check(n > 0 && testReplay(zOpts, aLog, n, -1) == 100);
+    free(aLog);
+}
+
+int main(void){
+    static const char *azOpts[] = { "dirtyPgsz=4096", "dirtyPgsz=4096&delta=1" };
+    size_t i;
+
+    check(sqlite3_auroravfs_init(NULL, NULL, NULL) == SQLITE_OK_LOAD_PERMANENTLY);
+    check(mkdtemp(zDir) != NULL);
+    aRegion = malloc(TEST_SZ);
+
+    for (i = 0; i < sizeof(azOpts) / sizeof(azOpts[0]); i++) {
+	testRecovery(azOpts[i]);
+	testCompact(azOpts[i]);
+    }
+
+    free(aRegion);
+    unlink(sqlite3_mprintf("%s/build.log", zDir));
+    unlink(sqlite3_mprintf("%s/replay.log", zDir));
+    unlink(sqlite3_mprintf("%s/compact.log", zDir));
+    rmdir(zDir);
+
+    if (nFail > 0) {
+	fprintf(stderr, "log: %d checks failed\n", nFail);
+	return 1;
+    }
+    printf("log: ok\n");
+
+    return 0;
+}
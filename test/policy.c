@@ -0,0 +1,216 @@
+/*
+** The policy= parser: well-formed expressions build the expected tree,
+** malformed ones and policies the mode cannot honour keep the file from
+** opening, and the policies fire when they should.
+*/
+#include "../src/auroravfs.c"
+
+static int nFail = 0;
+
+#define check(x) do { \
+    if (!(x)) { \
+	fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+	nFail++; \
+    } \
+} while (0)
+
+/* Parse all of zPolicy, as auroraPolicyInit() does. NULL if it fails. */
+static AuroraPolicy *testParse(const char *zPolicy){
+    AuroraPolicy *pPolicy = auroraPolicyParse(&zPolicy);
+
+    if (pPolicy != NULL && *zPolicy != '\0') {
+	auroraPolicyFree(pPolicy);
+	return NULL;
+    }
+
+    return pPolicy;
+}
+
+static void testSyntax(void){
+    static const char *azGood[] = {
+	"sync", "bytes:0", "bytes:4096", "bytes:0x1000", "commits:10",
+	"time:100", "idle:5", "adaptive", "or(sync)", "and(bytes:1,commits:2)",
+	"or(sync,and(time:10,bytes:100),idle:3)",
+    };
+    static const char *azBad[] = {
+	"", "nope", "syncs", "sync:1", "bytes", "bytes:", "bytes:x",
+	"bytes:-1", "commits:1x", "and", "and()", "and(", "and(sync",
+	"and(sync,)", "or(sync))", "or(,sync)", "or(sync;bytes:1)",
+	"and(bytes:1,nope)", " sync", "sync ",
+    };
+    AuroraPolicy *pPolicy, *pChild;
+    size_t i;
+
+    for (i = 0; i < sizeof(azGood) / sizeof(azGood[0]); i++) {
+	pPolicy = testParse(azGood[i]);
+	if (pPolicy == NULL)
+	    fprintf(stderr, "refused \"%s\"\n", azGood[i]);
+	check(pPolicy != NULL);
+	auroraPolicyFree(pPolicy);
+    }
+
+    for (i = 0; i < sizeof(azBad) / sizeof(azBad[0]); i++) {
+	pPolicy = testParse(azBad[i]);
+	if (pPolicy != NULL)
+	    fprintf(stderr, "accepted \"%s\"\n", azBad[i]);
+	check(pPolicy == NULL);
+	auroraPolicyFree(pPolicy);
+    }
+
+    /* The tree has the children in order, with their arguments. */
+    pPolicy = testParse("or(sync,and(time:10,bytes:0x100))");
+    check(pPolicy != NULL && pPolicy->xDue == auroraPolicyOr);
+    if (pPolicy != NULL) {
+	pChild = pPolicy->pChild;
+	check(pChild != NULL && pChild->xDue == auroraPolicySync);
+	pChild = pChild != NULL ? pChild->pNext : NULL;
+	check(pChild != NULL && pChild->xDue == auroraPolicyAnd && pChild->pNext == NULL);
+	pChild = pChild != NULL ? pChild->pChild : NULL;
+	check(pChild != NULL && pChild->xDue == auroraPolicyTime && pChild->iArg == 10);
+	pChild = pChild != NULL ? pChild->pNext : NULL;
+	check(pChild != NULL && pChild->xDue == auroraPolicyBytes && pChild->iArg == 256);
+	check(auroraPolicyTickUs(pPolicy) == 10 * 500);
+	check(auroraPolicyHas(pPolicy, auroraPolicyBytes));
+	check(!auroraPolicyHas(pPolicy, auroraPolicyIdle));
+    }
+    auroraPolicyFree(pPolicy);
+}
+
+/* Evaluate the leaf and composite policies against a file's counters. */
+static void testEval(void){
+    AuroraFile file;
+    AuroraPolicy *pPolicy;
+    sqlite3_int64 iNow = 1000000000;
+
+    memset(&file, 0, sizeof(file));
+    file.iLastCkptUs = file.iLastWriteUs = iNow;
+
+    pPolicy = testParse("bytes:100");
+    file.szWritten = 100;
+    check(!pPolicy->xDue(pPolicy, &file, AURORA_EV_WRITE, iNow));
+    file.szWritten = 101;
+    check(pPolicy->xDue(pPolicy, &file, AURORA_EV_WRITE, iNow));
+    auroraPolicyFree(pPolicy);
+
+    /* Nothing to checkpoint, so no checkpoint however long it has been. */
+    pPolicy = testParse("or(commits:2,time:5,idle:5,sync)");
+    file.szWritten = 0;
+    file.nCommit = 10;
+    check(!pPolicy->xDue(pPolicy, &file, AURORA_EV_SYNC, iNow + 60000000));
+    check(!pPolicy->xDue(pPolicy, &file, AURORA_EV_TICK, iNow + 60000000));
+    auroraPolicyFree(pPolicy);
+
+    pPolicy = testParse("and(commits:2,time:5)");
+    file.szWritten = 1;
+    file.nCommit = 2;
+    check(!pPolicy->xDue(pPolicy, &file, AURORA_EV_COMMIT, iNow + 4999));
+    check(pPolicy->xDue(pPolicy, &file, AURORA_EV_COMMIT, iNow + 5000));
+    file.nCommit = 1;
+    check(!pPolicy->xDue(pPolicy, &file, AURORA_EV_COMMIT, iNow + 5000));
+    auroraPolicyFree(pPolicy);
+
+    /* Idle only fires when the checkpointer polls. */
+    pPolicy = testParse("idle:5");
+    check(!pPolicy->xDue(pPolicy, &file, AURORA_EV_COMMIT, iNow + 5000));
+    check(pPolicy->xDue(pPolicy, &file, AURORA_EV_TICK, iNow + 5000));
+    check(!pPolicy->xDue(pPolicy, &file, AURORA_EV_TICK, iNow + 4999));
+    auroraPolicyFree(pPolicy);
+}
+
+static unsigned char *aRegion;
+
+#define TEST_SZ (4 * 1024 * 1024)
+
+static int testOpen(const char *zOpts, sqlite3 **pDb){
+    char zUri[512];
+
+    memset(aRegion, 0, TEST_SZ);
+    snprintf(zUri, sizeof(zUri),
+	"file:policy.db?ptr=%p&sz=0&max=%d&backend=none&%s",
+	(void *)aRegion, TEST_SZ, zOpts);
+
+    return sqlite3_open_v2(zUri, pDb,
+	SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_URI, "auroravfs");
+}
+
+/* Whole URIs, where the mode and other parameters come into it. */
+static void testUri(void){
+    static const struct {
+	const char *zOpts;
+	bool bOk;
+    } aCase[] = {
+	{ "policy=or(sync,bytes:100)", true },
+	{ "policy=or(sync,bytes:100)x", false },
+	{ "policy=", false },
+	{ "policy=idle:10", false },
+	{ "policy=idle:10&ckptMode=async", true },
+	{ "policy=adaptive", false },
+	{ "policy=adaptive&targetCkptUs=1000", true },
+	{ "threshold=100&ckptOnSync=0", true },
+    };
+    sqlite3 *db;
+    size_t i;
+    int rc;
+
+    for (i = 0; i < sizeof(aCase) / sizeof(aCase[0]); i++) {
+	rc = testOpen(aCase[i].zOpts, &db);
+	if (rc == SQLITE_OK)
+	    rc = sqlite3_exec(db, "PRAGMA user_version", NULL, NULL, NULL);
+	if ((rc == SQLITE_OK) != aCase[i].bOk)
+	    fprintf(stderr, "%s: %s\n", aCase[i].zOpts, sqlite3_errstr(rc));
+	check((rc == SQLITE_OK) == aCase[i].bOk);
+	sqlite3_close(db);
+    }
+}
+
+static sqlite3_uint64 testDurable(sqlite3 *db){
+    AuroraEpochs epochs;
+
+    memset(&epochs, 0, sizeof(epochs));
+    check(sqlite3_file_control(db, "main", AURORA_FCNTL_EPOCHS, &epochs) == SQLITE_OK);
+
+    return epochs.iDurable;
+}
+
+/* commits:N checkpoints at the end of every Nth transaction. */
+static void testCommits(void){
+    sqlite3_uint64 iDurable;
+    sqlite3 *db;
+    int i;
+
+    check(testOpen("policy=commits:3", &db) == SQLITE_OK);
+    check(sqlite3_exec(db, "PRAGMA journal_mode=MEMORY; CREATE TABLE t(a)",
+	NULL, NULL, NULL) == SQLITE_OK);
+
+    /* Line up with a checkpoint first, wherever CREATE TABLE left us. */
+    iDurable = testDurable(db);
+    for (i = 0; i < 3 && testDurable(db) == iDurable; i++)
+	check(sqlite3_exec(db, "INSERT INTO t VALUES(1)", NULL, NULL, NULL) == SQLITE_OK);
+    check(testDurable(db) == iDurable + 1);
+
+    iDurable = testDurable(db);
+    for (i = 1; i <= 6; i++) {
+	check(sqlite3_exec(db, "INSERT INTO t VALUES(1)", NULL, NULL, NULL) == SQLITE_OK);
+	check(testDurable(db) == iDurable + i / 3);
+    }
+    sqlite3_close(db);
+}
+
+int main(void){
+    check(sqlite3_auroravfs_init(NULL, NULL, NULL) == SQLITE_OK_LOAD_PERMANENTLY);
+    aRegion = malloc(TEST_SZ);
+
+    testSyntax();
+    testEval();
+    testUri();
+    testCommits();
+
+    free(aRegion);
+    if (nFail > 0) {
+	fprintf(stderr, "policy: %d checks failed\n", nFail);
+	return 1;
+    }
+    printf("policy: ok\n");
+
+    return 0;
+}